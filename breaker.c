@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2023 Pierre Colin
+ * This file is part of the serve utility.
+ * 
+ * The serve utility is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * The serve utility is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "breaker.h"
+#include "command.h"
+#include "log.h"
+#include "metrics.h"
+
+/*
+ * Circuit breaker on worker processes failing early.  A session fails early
+ * when its command cannot be run, or when it exits unsuccessfully sooner than
+ * the configured lifetime.  The outcomes of the last sessions are kept as
+ * bits of history, the newest being the least significant.  Once too many of
+ * them failed, the breaker opens and no process is created.  Every probe
+ * period, one process is created to probe the command: if it lives longer
+ * than the lifetime or exits successfully, the breaker closes.
+ */
+static int state = BREAKER_CLOSED;
+static uint_least64_t history;
+static uint_fast32_t outcomes, failures;
+static uint_fast64_t since;
+static pid_t probe;
+
+static void setstate(const int s, const uint_fast64_t now)
+{
+	state = s;
+	since = now;
+	gauges[GAUGE_BREAKER] = s;
+}
+
+static void reset(const uint_fast64_t now)
+{
+	history = 0;
+	outcomes = failures = 0;
+	probe = 0;
+	setstate(BREAKER_CLOSED, now);
+	logprintf("Circuit breaker closed\n");
+}
+
+/* Whether a worker process may be created now. */
+bool breakerallows(const uint_fast64_t now)
+{
+	const BreakerOptions * const opts = getbreaker();
+	if (state == BREAKER_CLOSED)
+		return true;
+	/* a probe that never got a process is retried after a period too */
+	if (now - since < opts->probe
+		|| (state == BREAKER_PROBING && probe != 0))
+		return false;
+	setstate(BREAKER_PROBING, now);
+	probe = 0;
+	return true;
+}
+
+/* Tell the breaker that process pid was created. */
+void breakerstart(const pid_t pid, const uint_fast64_t now)
+{
+	if (state == BREAKER_PROBING && probe == 0) {
+		probe = pid;
+		since = now;
+	}
+}
+
+/*
+ * Tell the breaker that process pid ended after lifetime milliseconds, having
+ * failed if failed is set.  A pid of 0 means that no process could be created.
+ */
+void breakerend(const pid_t pid, const bool failed,
+	const uint_fast64_t lifetime, const uint_fast64_t now)
+{
+	const BreakerOptions * const opts = getbreaker();
+	if (opts->window == 0)
+		return;
+	const bool early = failed && lifetime < opts->lifetime;
+	if (state == BREAKER_PROBING && (pid == probe || probe == 0)) {
+		if (early) {
+			setstate(BREAKER_OPEN, now);
+			logprintf("Circuit breaker probe failed\n");
+		} else {
+			reset(now);
+		}
+		return;
+	}
+	if (state != BREAKER_CLOSED)
+		return;
+	if (outcomes == opts->window)
+		failures -= history >> (opts->window - 1) & 1;
+	else
+		outcomes++;
+	history = history << 1 | early;
+	failures += early;
+	if (outcomes == opts->window
+		&& 100 * failures >= (uint_fast64_t) opts->ratio * outcomes) {
+		setstate(BREAKER_OPEN, now);
+		logprintf("Circuit breaker open: %ju of the last %ju sessions "
+			"failed early\n", (uintmax_t) failures,
+			(uintmax_t) outcomes);
+	}
+}
+
+/* Close the breaker once the probe has lived long enough. */
+void breakertick(const uint_fast64_t now)
+{
+	if (state == BREAKER_PROBING && probe != 0
+		&& now - since >= getbreaker()->lifetime)
+		reset(now);
+}
+
+/* milliseconds until the running probe has lived long enough, or -1 */
+int breakertimeout(const uint_fast64_t now)
+{
+	if (state != BREAKER_PROBING || probe == 0)
+		return -1;
+	const uint_fast64_t end = since + getbreaker()->lifetime;
+	return end > now ? end - now : 0;
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2023 Pierre Colin
+ * This file is part of the serve utility.
+ * 
+ * The serve utility is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * The serve utility is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+enum {BREAKER_CLOSED, BREAKER_OPEN, BREAKER_PROBING};
+
+bool breakerallows(uint_fast64_t now);
+
+void breakerstart(pid_t pid, uint_fast64_t now);
+
+void breakerend(pid_t pid, bool failed, uint_fast64_t lifetime,
+	uint_fast64_t now);
+
+void breakertick(uint_fast64_t now);
+
+int breakertimeout(uint_fast64_t now);
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2023 Pierre Colin
+ * This file is part of the serve utility.
+ * 
+ * The serve utility is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * The serve utility is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bucket.h"
+
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+void bucketinit(Bucket * const bucket, const uint_fast32_t rate,
+	const uint_fast32_t burst, const uint_fast64_t now)
+{
+	bucket->rate = rate;
+	bucket->burst = burst < 1 ? 1 : burst;
+	bucket->milli = (uint_fast64_t) bucket->burst * 1000;
+	bucket->last = now;
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+uint_fast32_t bucketlevel(Bucket * const bucket, const uint_fast64_t now)
+{
+	if (bucket->rate == 0)
+		return UINT_FAST32_MAX;
+	const uint_fast64_t max = (uint_fast64_t) bucket->burst * 1000;
+	if (now > bucket->last) {
+		const uint_fast64_t elapsed = now - bucket->last;
+		/* rate per second is rate thousandths per millisecond */
+		if (elapsed >= max / bucket->rate + 1)
+			bucket->milli = max;
+		else if ((bucket->milli += elapsed * bucket->rate) > max)
+			bucket->milli = max;
+		bucket->last = now;
+	}
+	return bucket->milli / 1000;
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+bool bucketcan(Bucket * const bucket, const uint_fast32_t n,
+	const uint_fast64_t now)
+{
+	return bucketlevel(bucket, now) >= n;
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+void buckettake(Bucket * const bucket, const uint_fast32_t n)
+{
+	if (bucket->rate == 0)
+		return;
+	const uint_fast64_t m = (uint_fast64_t) n * 1000;
+	bucket->milli = bucket->milli > m ? bucket->milli - m : 0;
+}
+
+/* milliseconds until n tokens are available, as of the last refill */
+#ifdef __GNUC__
+__attribute__((nonnull (1), pure))
+#endif
+uint_fast64_t bucketwait(const Bucket * const bucket, const uint_fast32_t n)
+{
+	const uint_fast64_t m = (uint_fast64_t) n * 1000;
+	if (bucket->rate == 0 || bucket->milli >= m)
+		return 0;
+	return (m - bucket->milli + bucket->rate - 1) / bucket->rate;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2023 Pierre Colin
+ * This file is part of the serve utility.
+ * 
+ * The serve utility is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * The serve utility is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Token bucket refilled at rate tokens per second, holding at most burst
+ * tokens.  Amounts are kept in thousandths of a token so that refills at
+ * millisecond granularity stay exact.  A rate of zero means unlimited.
+ */
+typedef struct {
+	uint_fast64_t milli, last;
+	uint_fast32_t rate, burst;
+} Bucket;
+
+void bucketinit(Bucket *bucket, uint_fast32_t rate, uint_fast32_t burst,
+	uint_fast64_t now)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+/* whole tokens available, or UINT_FAST32_MAX if unlimited */
+uint_fast32_t bucketlevel(Bucket *bucket, uint_fast64_t now)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+bool bucketcan(Bucket *bucket, uint_fast32_t n, uint_fast64_t now)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+void buckettake(Bucket *bucket, uint_fast32_t n)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+uint_fast64_t bucketwait(const Bucket *bucket, uint_fast32_t n)
+#ifdef __GNUC__
+__attribute__((nonnull (1), pure))
+#endif
+;
@@ -19,6 +19,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <locale.h>
 #include <netinet/in.h>
 #include <stdbool.h>
@@ -31,22 +32,87 @@
 #include <unistd.h>
 
 #include "command.h"
+#include "sockopts.h"
+#include "state.h"
 
 #define DEFAULT_PORT 4869
+/* first descriptor passed by socket activation */
+#define LISTEN_FDS_START 3
 
 _Bool mknonblocking(int fildes);
+_Bool mkcloexec(int fildes);
 
-static char *command;
+static Service *services;
+static size_t nservices;
+/* services read by cmdreload() until cmdcommit() or cmdabandon() */
+static Service *fresh;
+static size_t nfresh;
+static char *config;
+/* control socket path of the -H option, or NULL */
+static char *handoff;
+/* new index of each service of the process this one replaced */
+static size_t *adopted, nadopted;
+/* address being parsed, and defaults of -t and -n before any -a */
 static struct sockaddr *address;
 static socklen_t address_len;
+/* listener opened beforehand for the address just parsed, or -1 */
+static int listenfd = -1;
 static int type = SOCK_STREAM, protocol;
-static int listener = -1;
+static uint_fast32_t servicesessions;
+static int errormode = ERRORS_PREFIX, errorfd = -1;
+/* path of the shell running commands, or NULL if none was found */
+static char *shell;
+static uint_fast32_t maxsessions;
+static SourceLimits sourcelimits;
+static OverloadPolicy overload;
+static QueueOptions queueoptions;
+static SpawnLimit spawnlimit;
+static BreakerOptions breaker;
+static DeferOptions deferoptions;
+static PrereadOptions preread;
+static WorkerLimits workerlimits;
+static SocketOptions socketoptions;
+static DatagramOptions datagram = {
+	.batch = 32, .size = 65535, .idle = 30000
+};
+/* the initial maximum is unset until given, defaulting within the bounds */
+static AdaptiveLimit adaptive = {
+	.initial = UINT_FAST32_MAX, .min = 1, .tolerance = 150
+};
+static LogOptions logoptions = {.keep = 1, .buffer = 262144, .precision = 3};
+
+/* Free a list of services, closing what they own. */
+static void freeservices(Service * const list, const size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		free(list[i].address);
+		free(list[i].command);
+		for (size_t j = 0; j < list[i].nroutes; j++) {
+			free(list[i].routes[j].pattern);
+			free(list[i].routes[j].command);
+			free(list[i].routes[j].any);
+		}
+		free(list[i].routes);
+		if (list[i].listener >= 0)
+			close(list[i].listener);
+		if (list[i].errorfd > STDERR_FILENO
+			&& list[i].errorfd != errorfd)
+			close(list[i].errorfd);
+	}
+	free(list);
+}
 
 static void cleanup()
 {
+	cmdabandon();
+	freeservices(services, nservices);
+	free(adopted);
 	free(address);
-	if (listener >= 0)
-		close(listener);
+	free(overload.reply);
+	free(preread.delimiter);
+	free(shell);
+	if (errorfd > STDERR_FILENO)
+		close(errorfd);
 }
 
 #ifdef __GNUC__
@@ -54,13 +120,21 @@ __attribute__((nonnull (1)))
 #endif
 static void usage(const char * const restrict cmd)
 {
+	static const char options[] =
+		"[-e errors] [-c sessions] [-A adaptive] [-q queue] [-s spawn] "
+		"[-b breaker] [-d defer] [-r preread] [-R rlimits] "
+		"[-m datagram] [-o sockopts] [-H control] [-P limits] "
+		"[-O overload] [-l logopts]";
 	fprintf(stderr,
-		"usage: %s [-a address] [-t type] [-p protocol] command\n",
-		cmd);
+		"usage: %s [-a address [-t type] [-p protocol] [-n sessions] "
+		"[-w route]...]... "
+		"%s command...\n"
+		"       %s -f file [-t type] [-n sessions] %s\n",
+		cmd, options, cmd, options);
 }
 
 #ifdef __GNUC__
-__attribute__((nonnull (1, 2), const))
+__attribute__((nonnull (1, 2), pure))
 #endif
 static int compare(const void *a, const void *b)
 {
@@ -232,10 +306,43 @@ static int setaddressunix(const char * const restrict addrstr)
 	return 1;
 }
 
+/*
+ * Use descriptor fd, a socket opened beforehand, rather than opening one.  Its
+ * address only serves to recognize it on a reload.
+ */
+static int setaddressfd(const int fd)
+{
+	address_len = sizeof (struct sockaddr_storage);
+	struct sockaddr * const addr = calloc(1, address_len);
+	if (!addr)
+		return -1;
+	if (getsockname(fd, addr, &address_len) < 0) {
+		const int error = errno;
+		free(addr);
+		errno = error;
+		return -1;
+	}
+	address = addr;
+	listenfd = fd;
+	return 1;
+}
+
 static int setaddress(const char * restrict addr)
 {
 	free(address);
 	address = NULL;
+	listenfd = -1;
+	if (strncmp(addr, "fd ", 3) == 0) {
+		char *end;
+		errno = 0;
+		const long fd = strtol(addr + 3, &end, 10);
+		if (addr[3] < '0' || addr[3] > '9' || *end || errno
+			|| fd > INT_MAX) {
+			fprintf(stderr, "Invalid descriptor '%s'\n", addr + 3);
+			return 0;
+		}
+		return setaddressfd(fd);
+	}
 	sa_family_t af;
 	const char *s = strchr(addr, ' ');
 	if (s) {
@@ -264,131 +371,1523 @@ static int setaddress(const char * restrict addr)
 	}
 }
 
-static bool processopt(int c)
+/*
+ * Add to list a service on the address just parsed, with the defaults of the
+ * command line.  Return true on failure.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2)))
+#endif
+static bool addservice(Service ** const list, size_t * const n)
 {
-	switch (c) {
-	case 'a':
-		if ((c = setaddress(optarg)) < 0) {
-			perror("Could not set listening address");
-			exit(EXIT_FAILURE);
+	Service * const newptr = realloc(*list, (*n + 1) * sizeof **list);
+	if (!newptr)
+		return true;
+	*list = newptr;
+	newptr[(*n)++] = (Service) {
+		.address = address,
+		.address_len = address_len,
+		.type = type,
+		.protocol = protocol,
+		.listener = listenfd,
+		.maxsessions = servicesessions,
+		.errormode = errormode,
+		.errorfd = errorfd,
+		.sockopts = socketoptions
+	};
+	address = NULL;
+	listenfd = -1;
+	return false;
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2)))
+#endif
+static bool parsecount(const char * const restrict str,
+	uint_fast32_t * const restrict value)
+{
+	char *end;
+	if (*str < '0' || *str > '9')
+		return true;
+	errno = 0;
+	const unsigned long v = strtoul(str, &end, 10);
+	if (*end || errno || v > UINT32_MAX)
+		return true;
+	*value = v;
+	return false;
+}
+
+/*
+ * Parse a list of suboptions.  keys is NULL-terminated, and for each key,
+ * either counts has a pointer to a number or strings has a pointer to a
+ * string.  strings may be NULL if all suboptions are numbers.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2, 3, 4)))
+#endif
+static bool setsubopts(char *opts, const char * const restrict what,
+	char * const keys[], uint_fast32_t * const counts[],
+	char ** const strings[])
+{
+	bool error = false;
+	while (*opts) {
+		char *value;
+		const int k = getsubopt(&opts, keys, &value);
+		if (k < 0) {
+			fprintf(stderr, "Unrecognized %s option '%s'\n", what,
+				value);
+			error = true;
+		} else if (counts[k]) {
+			if (!value || parsecount(value, counts[k])) {
+				fprintf(stderr,
+					"The %s option '%s' requires a number\n",
+					what, keys[k]);
+				error = true;
+			}
+		} else if (!value || !*value) {
+			fprintf(stderr, "The %s option '%s' requires a value\n",
+				what, keys[k]);
+			error = true;
+		} else {
+			*strings[k] = value;
 		}
-		return c == 0;
-	case 'p':
-		fputs("Protocol specification unimplemented; using stream\n",
-		      stderr);
-		return false;
-	case 't':
-		if ((c = gettype(optarg)) < 0 && errno != 0) {
-			fprintf(stderr, "Unsupported socket type '%s'\n",
-				optarg);
+	}
+	return error;
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+static bool setlogopts(char * const opts)
+{
+	static char * const keys[] = {
+		"bytes", "lines", "totalbytes", "totallines",
+		"file", "size", "age", "keep", "buffer",
+		"time", "precision", NULL
+	};
+	/* s MUST be sorted lexicographically */
+	static const char *s[] = {"both", "monotonic", "none", "wall"};
+	static const int v[] = {
+		LOG_WALL | LOG_MONOTONIC, LOG_MONOTONIC, 0, LOG_WALL
+	};
+	char *clocks = NULL;
+	uint_fast32_t * const counts[] = {
+		&logoptions.bytes, &logoptions.lines,
+		&logoptions.totalbytes, &logoptions.totallines,
+		NULL, &logoptions.size, &logoptions.age, &logoptions.keep,
+		&logoptions.buffer, NULL, &logoptions.precision
+	};
+	char ** const strings[] = {
+		NULL, NULL, NULL, NULL, &logoptions.file, NULL, NULL, NULL, NULL,
+		&clocks, NULL
+	};
+	if (setsubopts(opts, "log", keys, counts, strings))
+		return true;
+	if (logoptions.buffer < 1024) {
+		fputs("The log buffer must hold at least 1024 bytes\n", stderr);
+		return true;
+	}
+	if (logoptions.precision > 9) {
+		fputs("The log time precision cannot exceed 9 digits\n", stderr);
+		return true;
+	}
+	if (clocks) {
+		const char **x = bsearch(&clocks, s, sizeof s / sizeof s[0],
+			sizeof (const char *), compare);
+		if (!x) {
+			fprintf(stderr, "Unrecognized log time '%s'\n", clocks);
 			return true;
 		}
-		return false;
-	case ':':
-		fprintf(stderr, "Option -%c requires an operand\n",
-			optopt);
+		logoptions.clocks = v[x - s];
+	}
+	return false;
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+static bool setsourceopts(char * const opts)
+{
+	static char * const keys[] = {"sessions", "rate", "burst", NULL};
+	uint_fast32_t * const counts[] = {
+		&sourcelimits.sessions, &sourcelimits.rate, &sourcelimits.burst
+	};
+	if (setsubopts(opts, "source", keys, counts, NULL))
 		return true;
-	default:
-		fprintf(stderr, "Unrecognized option '-%c'\n", optopt);
+	if (sourcelimits.burst == 0)
+		sourcelimits.burst = sourcelimits.rate;
+	return false;
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+static bool setadaptiveopts(char * const opts)
+{
+	static char * const keys[] = {
+		"initial", "min", "max", "tolerance", NULL
+	};
+	uint_fast32_t * const counts[] = {
+		&adaptive.initial, &adaptive.min, &adaptive.max,
+		&adaptive.tolerance
+	};
+	adaptive.enabled = true;
+	return setsubopts(opts, "adaptive", keys, counts, NULL);
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+static bool setspawnopts(char * const opts)
+{
+	static char * const keys[] = {"rate", "burst", NULL};
+	uint_fast32_t * const counts[] = {&spawnlimit.rate, &spawnlimit.burst};
+	if (setsubopts(opts, "spawn", keys, counts, NULL))
+		return true;
+	if (spawnlimit.burst == 0)
+		spawnlimit.burst = spawnlimit.rate;
+	return false;
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+static bool setbreakeropts(char * const opts)
+{
+	static char * const keys[] = {
+		"window", "ratio", "lifetime", "probe", NULL
+	};
+	uint_fast32_t * const counts[] = {
+		&breaker.window, &breaker.ratio, &breaker.lifetime,
+		&breaker.probe
+	};
+	breaker = (BreakerOptions) {
+		.window = 20, .ratio = 50, .lifetime = 500, .probe = 1000
+	};
+	if (setsubopts(opts, "breaker", keys, counts, NULL))
+		return true;
+	/* the outcomes are kept as bits of a 64-bit integer */
+	if (breaker.window > 64 || breaker.ratio > 100) {
+		fputs("Breaker window must be at most 64 and ratio at most "
+		      "100\n", stderr);
 		return true;
 	}
+	return false;
 }
 
 #ifdef __GNUC__
-__attribute__((nonnull (2)))
+__attribute__((nonnull (1)))
 #endif
-static void argparse(const int argc, char * const argv[])
+static bool setdeferopts(char * const opts)
 {
-	assert(command == NULL);
-	if (argc < 2) {
-		fputs("Missing operand\n", stderr);
-		usage(argc > 0 ? argv[0] : "serve");
-		exit(2);
+	static char * const keys[] = {"timeout", "size", NULL};
+	uint_fast32_t * const counts[] = {
+		&deferoptions.timeout, &deferoptions.size
+	};
+	deferoptions = (DeferOptions) {.timeout = 2000, .size = 256};
+	if (setsubopts(opts, "defer", keys, counts, NULL))
+		return true;
+	if (deferoptions.timeout > 0 && deferoptions.size == 0) {
+		fputs("At least one connection must be able to wait for data\n",
+		      stderr);
+		return true;
 	}
-	atexit(cleanup);
-	int c;
+	if (deferoptions.timeout == 0)
+		deferoptions.size = 0;
+	return false;
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+static bool setqueueopts(char *opts)
+{
+	static char * const keys[] = {"size", "timeout", "reply", NULL};
+	uint_fast32_t * const counts[] = {
+		&queueoptions.size, &queueoptions.timeout
+	};
 	bool error = false;
-	while ((c = getopt(argc, argv, ":a:p:t:")) != -1)
-		error |= processopt(c);
-	if (!address && setaddressinet(NULL) < 0) {
-		perror("Could not set default listening address");
-		exit(EXIT_FAILURE);
+	while (*opts) {
+		char *value;
+		const int k = getsubopt(&opts, keys, &value);
+		if (k == 2) {
+			queueoptions.reply = true;
+		} else if (k < 0) {
+			fprintf(stderr, "Unrecognized queue option '%s'\n",
+				value);
+			error = true;
+		} else if (!value || parsecount(value, counts[k])) {
+			fprintf(stderr,
+				"The queue option '%s' requires a number\n",
+				keys[k]);
+			error = true;
+		}
 	}
-	if (optind >= argc) {
-		fputs("Missing operand\n", stderr);
-		error = true;
-	} else if (optind < argc - 1) {
-		fputs("Only one operand is expected\n", stderr);
-		error = true;
+	return error;
+}
+
+/* Default the bounds of the adaptive limit and check them. */
+static bool checkadaptive(void)
+{
+	if (!adaptive.enabled)
+		return false;
+	if (adaptive.max == 0
+		|| (maxsessions > 0 && adaptive.max > maxsessions))
+		adaptive.max = maxsessions > 0 ? maxsessions : 1000;
+	if (adaptive.initial == UINT_FAST32_MAX) {
+		adaptive.initial = 10;
+		if (adaptive.initial > adaptive.max)
+			adaptive.initial = adaptive.max;
+		if (adaptive.initial < adaptive.min)
+			adaptive.initial = adaptive.min;
 	}
-	if (error) {
-		usage(argv[0]);
-		exit(2);
+	if (adaptive.min < 1 || adaptive.min > adaptive.initial
+		|| adaptive.initial > adaptive.max) {
+		fputs("The adaptive limit requires 1 <= min <= initial <= max\n",
+			stderr);
+		return true;
+	}
+	if (adaptive.tolerance < 100) {
+		fputs("The adaptive tolerance must be at least 100 percent\n",
+			stderr);
+		return true;
 	}
-	command = argv[optind];
+	return false;
 }
 
-void cmdexec()
+#ifdef __GNUC__
+__attribute__((const))
+#endif
+static int hexdigit(const char c)
 {
-	assert(command != NULL);
-	char *argv[4] = {"sh", "-c", command, NULL};
-	execvp(argv[0], argv);
+	static const char digits[] = "0123456789abcdef";
+	const char * const d = c ? strchr(digits, c | 0x20) : NULL;
+	return d ? d - digits : -1;
 }
 
-static void mklistener()
+/*
+ * Decode backslash escapes: \\, \n, \r, \t and \x followed by two
+ * hexadecimal digits.  The result may contain null bytes; its length is
+ * stored in length.  If any is not NULL, it must have room for as many
+ * entries as s has bytes, and ? stands for any byte, setting its entry, while
+ * \? stands for itself.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2)))
+#endif
+static char *unescape(const char * restrict s, size_t * const restrict length,
+	bool * const restrict any)
 {
-	assert(address != NULL);
-	if ((listener = socket(address->sa_family, type, protocol)) < 0) {
-		perror("Could not create listener socket");
-		exit(EXIT_FAILURE);
+	char * const r = malloc(strlen(s) + 1);
+	if (!r)
+		return NULL;
+	size_t n = 0;
+	while (*s) {
+		if (any)
+			any[n] = *s == '?';
+		if (*s != '\\') {
+			r[n++] = *s++;
+			continue;
+		}
+		switch (*++s) {
+		case '\\':
+			r[n++] = '\\';
+			break;
+		case '?':
+			if (!any)
+				goto invalid;
+			r[n++] = '?';
+			break;
+		case 'n':
+			r[n++] = '\n';
+			break;
+		case 'r':
+			r[n++] = '\r';
+			break;
+		case 't':
+			r[n++] = '\t';
+			break;
+		case 'x':
+			if (hexdigit(s[1]) < 0 || hexdigit(s[2]) < 0)
+				goto invalid;
+			r[n++] = hexdigit(s[1]) << 4 | hexdigit(s[2]);
+			s += 2;
+			break;
+		default:
+			goto invalid;
+		}
+		s++;
 	}
-	if (bind(listener, address, address_len) < 0) {
-		perror("Could not assign address to listener socket");
-		exit(EXIT_FAILURE);
+	*length = n;
+	return r;
+
+invalid:
+	free(r);
+	errno = EINVAL;
+	return NULL;
+}
+
+/*
+ * Add a route running command on connections to service whose first bytes
+ * match pattern.  Return true on failure.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2, 3)))
+#endif
+static bool addroute(Service * const service, const char * const pattern,
+	const char * const command)
+{
+	Route r = {.any = malloc(strlen(pattern) + 1)};
+	if (!r.any || !(r.pattern = unescape(pattern, &r.length, r.any))) {
+		fprintf(stderr, "Invalid route pattern '%s': %s\n", pattern,
+			strerror(errno));
+		free(r.any);
+		return true;
 	}
-	const int f = fcntl(listener, F_GETFD);
-	if (f < 0)
-		perror("Could not get listener socket descriptor flags");
-	else if (fcntl(listener, F_SETFD, f | FD_CLOEXEC) < 0)
-		perror("Could not set listener socket descriptor flags");
-	if (listen(listener, SOMAXCONN) < 0) {
-		perror("Could not mark listener as accepting connections");
-		exit(EXIT_FAILURE);
+	if (r.length == 0 || r.length > ROUTE_MAX) {
+		fprintf(stderr, "Route patterns must have 1 to %d bytes\n",
+			ROUTE_MAX);
+		goto failure;
 	}
-	if (!mknonblocking(listener))
-		perror("Could not make listener socket nonblocking");
+	Route * const newptr = realloc(service->routes,
+		(service->nroutes + 1) * sizeof *newptr);
+	if (!newptr || !(r.command = strdup(command))) {
+		perror("Could not add route");
+		goto failure;
+	}
+	service->routes = newptr;
+	service->routes[service->nroutes++] = r;
+	return false;
+
+failure:
+	free(r.pattern);
+	free(r.any);
+	return true;
 }
 
+/*
+ * Add a route given as its pattern and command separated by the first
+ * space to service.  Return true on failure.
+ */
 #ifdef __GNUC__
-__attribute__((nonnull (2)))
+__attribute__((nonnull (1, 2)))
 #endif
-static void setlocaletype(int type, const char * const restrict str)
+static bool setroute(Service * const service, char * const route)
 {
-	const char *env = getenv(str);
-	if (env && !setlocale(type, env)) {
-		fprintf(stderr, "Could not set %s to %s\n", str, env);
-		exit(EXIT_FAILURE);
+	char * const space = strchr(route, ' ');
+	if (!space || !space[1]) {
+		fputs("Routes need a pattern and a command separated by a "
+			"space\n", stderr);
+		return true;
 	}
+	*space = 0;
+	const bool error = addroute(service, route, space + 1);
+	*space = ' ';
+	return error;
 }
 
 #ifdef __GNUC__
-__attribute__((nonnull (2)))
+__attribute__((nonnull (1)))
 #endif
-void init(const int argc, char * const argv[])
+static bool setoverloadopts(char *opts)
 {
-	setlocaletype(LC_ALL, "LANG");
-	setlocaletype(LC_COLLATE, "LC_COLLATE");
-	setlocaletype(LC_CTYPE, "LC_CTYPE");
-	setlocaletype(LC_NUMERIC, "LC_NUMERIC");
-	setlocaletype(LC_ALL, "LC_ALL");
-	argparse(argc, argv);
-	mklistener();
+	static char * const keys[] = {"reply", "full", "load", "backlog", NULL};
+	bool error = false;
+	while (*opts) {
+		char *value, *end;
+		const int k = getsubopt(&opts, keys, &value);
+		switch (k) {
+		case 0:
+			free(overload.reply);
+			overload.reply = unescape(value ? value : "",
+				&overload.length, NULL);
+			if (!overload.reply) {
+				fprintf(stderr, "Invalid overload reply: %s\n",
+					strerror(errno));
+				error = true;
+			}
+			break;
+		case 1:
+			overload.full = true;
+			break;
+		case 2:
+			errno = 0;
+			overload.load = value ? strtod(value, &end) : -1;
+			if (!value || *end || errno || overload.load < 0) {
+				fputs("The overload option 'load' requires a "
+					"nonnegative number\n", stderr);
+				error = true;
+			}
+			break;
+		case 3:
+			if (!value || parsecount(value, &overload.backlog)) {
+				fputs("The overload option 'backlog' requires "
+					"a number\n", stderr);
+				error = true;
+			}
+			break;
+		default:
+			fprintf(stderr, "Unrecognized overload option '%s'\n",
+				value);
+			error = true;
+		}
+	}
+	return error;
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+static bool setdgramopts(char * const opts)
+{
+	static char * const keys[] = {
+		"mode", "batch", "size", "idle", NULL
+	};
+	/* s MUST be sorted lexicographically */
+	static const char *s[] = {"batch", "each", "peer"};
+	static const int v[] = {DGRAM_BATCH, DGRAM_EACH, DGRAM_PEER};
+	char *mode = NULL;
+	uint_fast32_t * const counts[] = {
+		NULL, &datagram.batch, &datagram.size, &datagram.idle
+	};
+	char ** const strings[] = {&mode, NULL, NULL, NULL};
+	if (setsubopts(opts, "datagram", keys, counts, strings))
+		return true;
+	if (datagram.batch == 0 || datagram.batch > 1024
+		|| datagram.size == 0 || datagram.size > 65535) {
+		fputs("Datagram batches must hold 1 to 1024 datagrams of 1 to "
+		      "65535 bytes\n", stderr);
+		return true;
+	}
+	if (datagram.idle == 0) {
+		fputs("Datagram peers must have a positive idle time\n",
+			stderr);
+		return true;
+	}
+	if (mode) {
+		const char **x = bsearch(&mode, s, sizeof s / sizeof s[0],
+			sizeof (const char *), compare);
+		if (!x) {
+			fprintf(stderr, "Unrecognized datagram mode '%s'\n",
+				mode);
+			return true;
+		}
+		datagram.mode = v[x - s];
+	}
+	return false;
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+static bool setrlimitopts(char *opts)
+{
+	static char * const keys[] = {
+		"cpu", "as", "nofile", "nice", "ioclass", "iolevel", NULL
+	};
+	static const char * const classes[] = {
+		"realtime", "best-effort", "idle"
+	};
+	uint_fast32_t * const counts[] = {
+		&workerlimits.cpu, &workerlimits.as, &workerlimits.nofile,
+		NULL, NULL, &workerlimits.iolevel
+	};
+	bool error = false;
+	while (*opts) {
+		char *value, *end;
+		long n;
+		const int k = getsubopt(&opts, keys, &value);
+		switch (k) {
+		case 3:
+			errno = 0;
+			n = value ? strtol(value, &end, 10) : 0;
+			if (!value || !*value || *end || errno
+				|| n < -20 || n > 19) {
+				fputs("The rlimit option 'nice' requires a "
+					"number from -20 to 19\n", stderr);
+				error = true;
+			}
+			workerlimits.setnice = true;
+			workerlimits.nice = n;
+			break;
+		case 4:
+			workerlimits.ioclass = IOCLASS_NONE;
+			for (int i = 0; value && i < 3; i++) {
+				if (strcmp(value, classes[i]) == 0)
+					workerlimits.ioclass = i + 1;
+			}
+			if (workerlimits.ioclass == IOCLASS_NONE) {
+				fputs("The rlimit option 'ioclass' requires "
+					"realtime, best-effort or idle\n",
+					stderr);
+				error = true;
+			}
+			break;
+		case -1:
+			fprintf(stderr, "Unrecognized rlimit option '%s'\n",
+				value);
+			error = true;
+			break;
+		default:
+			if (!value || parsecount(value, counts[k])) {
+				fprintf(stderr, "The rlimit option '%s' "
+					"requires a number\n", keys[k]);
+				error = true;
+			}
+		}
+	}
+	if (workerlimits.iolevel > 7) {
+		fputs("The I/O scheduling level must be at most 7\n", stderr);
+		error = true;
+	}
+	return error;
+}
+
+/*
+ * Parse the socket options opts into o.  A linger time is told apart from
+ * none by whether parsing changed it, since zero is meaningful and resets
+ * connections on close.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2)))
+#endif
+static bool setsocketopts(char * const opts, SocketOptions * const o)
+{
+	static char * const keys[] = {
+		"nodelay", "quickack", "sndbuf", "rcvbuf", "fastopen",
+		"keepidle", "keepintvl", "keepcnt", "busypoll", "linger", NULL
+	};
+	uint_fast32_t * const counts[] = {
+		&o->nodelay, &o->quickack, &o->sndbuf, &o->rcvbuf,
+		&o->fastopen, &o->keepidle, &o->keepintvl, &o->keepcnt,
+		&o->busypoll, &o->linger
+	};
+	const uint_fast32_t linger = o->linger;
+	o->linger = UINT_FAST32_MAX;
+	bool error = setsubopts(opts, "socket", keys, counts, NULL);
+	if (o->linger == UINT_FAST32_MAX)
+		o->linger = linger;
+	else
+		o->setlinger = true;
+	for (size_t i = 0; i < sizeof counts / sizeof *counts; i++) {
+		if (*counts[i] > INT_MAX) {
+			fprintf(stderr, "The socket option '%s' must be at "
+				"most %d\n", keys[i], INT_MAX);
+			error = true;
+		}
+	}
+	if (o->nodelay > 1 || o->quickack > 1) {
+		fputs("The socket options 'nodelay' and 'quickack' must be 0 "
+		      "or 1\n", stderr);
+		error = true;
+	}
+	return error;
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+static bool setprereadopts(char * const opts)
+{
+	static char * const keys[] = {"delimiter", "length", "timeout", NULL};
+	uint_fast32_t * const counts[] = {
+		NULL, &preread.length, &preread.timeout
+	};
+	char *delimiter = NULL;
+	char ** const strings[] = {&delimiter, NULL, NULL};
+	free(preread.delimiter);
+	preread = (PrereadOptions) {
+		.enabled = true, .length = 65536, .timeout = 5000
+	};
+	if (setsubopts(opts, "preread", keys, counts, strings))
+		return true;
+	if (delimiter && !(preread.delimiter = unescape(delimiter,
+		&preread.delimlength, NULL))) {
+		fprintf(stderr, "Invalid preread delimiter: %s\n",
+			strerror(errno));
+		return true;
+	}
+	if (preread.length == 0 || preread.timeout == 0) {
+		fputs("The preread length and timeout must not be zero\n",
+		      stderr);
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Set where the standard error of worker processes goes: "prefix" to have it
+ * line-buffered and logged, "raw" to log it as is, "stderr" for the standard
+ * error of serve itself, or "file" followed by a path to append it to a shared
+ * file.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2, 3)))
+#endif
+static bool seterrors(const char * const restrict mode, int * const restrict m,
+	int * const restrict fd)
+{
+	*fd = -1;
+	*m = ERRORS_PREFIX;
+	if (strcmp(mode, "prefix") == 0)
+		return false;
+	if (strcmp(mode, "raw") == 0) {
+		*m = ERRORS_RAW;
+		return false;
+	}
+	*m = ERRORS_DIRECT;
+	if (strcmp(mode, "stderr") == 0) {
+		*fd = STDERR_FILENO;
+		return false;
+	}
+	if (strncmp(mode, "file ", 5) != 0 || !mode[5]) {
+		fprintf(stderr, "Invalid error mode '%s'\n", mode);
+		return true;
+	}
+	*fd = open(mode + 5, O_WRONLY | O_CREAT | O_APPEND, 0666);
+	if (*fd < 0 || !mkcloexec(*fd)) {
+		fprintf(stderr, "Could not open error file '%s': %s\n",
+			mode + 5, strerror(errno));
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Parse a line of the configuration file into a service added to list.  Its
+ * fields are separated by tabs: address, type, number of sessions, error mode
+ * and command, the latter running until the end of the line.  Fields other
+ * than the address and command may be "-" for the defaults of the command
+ * line.  Lines whose first field is "route" rather add a route, given as its
+ * pattern and command, to the service of the line before, and those whose
+ * first field is "sockopts" set socket options on it as -o would.  Return
+ * true on failure.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2, 3)))
+#endif
+static bool parseservice(char *line, Service ** const list, size_t * const n)
+{
+	if (strncmp(line, "route\t", 6) == 0) {
+		char * const pattern = line + strspn(line + 5, "\t") + 5;
+		char *command = strchr(pattern, '\t');
+		if (command) {
+			*command++ = 0;
+			command += strspn(command, "\t");
+		}
+		if (*n == 0 || !command || !*command) {
+			fputs("Route lines need a pattern and a command after "
+				"a service line\n", stderr);
+			return true;
+		}
+		return addroute(&(*list)[*n - 1], pattern, command);
+	}
+	if (strncmp(line, "sockopts\t", 9) == 0) {
+		char * const opts = line + strspn(line + 8, "\t") + 8;
+		if (*n == 0 || !*opts) {
+			fputs("Socket option lines need options after a service "
+				"line\n", stderr);
+			return true;
+		}
+		return setsocketopts(opts, &(*list)[*n - 1].sockopts);
+	}
+	char *fields[5];
+	for (int i = 0; i < 4; i++) {
+		fields[i] = line;
+		if (!(line = strchr(line, '\t'))) {
+			fputs("Service lines need five fields\n", stderr);
+			return true;
+		}
+		*line++ = 0;
+		while (*line == '\t')
+			line++;
+	}
+	fields[4] = line;
+	const int r = setaddress(fields[0]);
+	if (r < 0)
+		perror("Could not set listening address");
+	if (r <= 0 || addservice(list, n))
+		return true;
+	Service * const service = &(*list)[*n - 1];
+	if (!(service->command = strdup(fields[4])))
+		return true;
+	if (strcmp(fields[1], "-") != 0
+		&& (service->type = gettype(fields[1])) < 0) {
+		fprintf(stderr, "Unsupported socket type '%s'\n", fields[1]);
+		return true;
+	}
+	if (strcmp(fields[2], "-") != 0
+		&& parsecount(fields[2], &service->maxsessions)) {
+		fprintf(stderr, "Invalid number of sessions '%s'\n",
+			fields[2]);
+		return true;
+	}
+	return strcmp(fields[3], "-") != 0 && seterrors(fields[3],
+		&service->errormode, &service->errorfd);
+}
+
+/*
+ * Read the services of the configuration file into list, skipping empty lines
+ * and those starting with #.  Return true on failure.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2)))
+#endif
+static bool loadservices(Service ** const list, size_t * const n)
+{
+	FILE * const file = fopen(config, "r");
+	if (!file) {
+		fprintf(stderr, "Could not open configuration file '%s': %s\n",
+			config, strerror(errno));
+		return true;
+	}
+	char *line = NULL;
+	size_t size = 0, lineno = 0;
+	ssize_t len;
+	bool error = false;
+	while (!error && (len = getline(&line, &size, file)) >= 0) {
+		lineno++;
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = 0;
+		if (len == 0 || line[0] == '#')
+			continue;
+		if ((error = parseservice(line, list, n)))
+			fprintf(stderr, "In configuration file '%s', line %zu\n",
+				config, lineno);
+	}
+	if (!error && ferror(file)) {
+		perror("Could not read configuration file");
+		error = true;
+	}
+	if (!error && *n == 0) {
+		fputs("The configuration file has no service\n", stderr);
+		error = true;
+	}
+	free(line);
+	fclose(file);
+	return error;
+}
+
+static bool processopt(int c)
+{
+	switch (c) {
+	case 'A':
+		return setadaptiveopts(optarg);
+	case 'a':
+		if ((c = setaddress(optarg)) < 0
+			|| (c > 0 && addservice(&services, &nservices))) {
+			perror("Could not set listening address");
+			exit(EXIT_FAILURE);
+		}
+		return c == 0;
+	case 'b':
+		return setbreakeropts(optarg);
+	case 'c':
+		if (parsecount(optarg, &maxsessions)) {
+			fprintf(stderr, "Invalid number of sessions '%s'\n",
+				optarg);
+			return true;
+		}
+		return false;
+	case 'd':
+		return setdeferopts(optarg);
+	case 'e':
+		if (errorfd > STDERR_FILENO)
+			close(errorfd);
+		return seterrors(optarg, &errormode, &errorfd);
+	case 'f':
+		config = optarg;
+		return false;
+	case 'H':
+		if (strlen(optarg)
+			>= sizeof ((struct sockaddr_un *) NULL)->sun_path) {
+			fprintf(stderr, "Unix socket path '%s' is too long.\n",
+				optarg);
+			return true;
+		}
+		handoff = optarg;
+		return false;
+	case 'l':
+		return setlogopts(optarg);
+	case 'm':
+		return setdgramopts(optarg);
+	case 'n':
+		/* like -t, applies to the last address or to all if none */
+		if (parsecount(optarg, nservices > 0
+			? &services[nservices - 1].maxsessions
+			: &servicesessions)) {
+			fprintf(stderr, "Invalid number of sessions '%s'\n",
+				optarg);
+			return true;
+		}
+		return false;
+	case 'O':
+		return setoverloadopts(optarg);
+	case 'o':
+		/* like -n, applies to the last address or to all if none */
+		return setsocketopts(optarg, nservices > 0
+			? &services[nservices - 1].sockopts : &socketoptions);
+	case 'q':
+		return setqueueopts(optarg);
+	case 'R':
+		return setrlimitopts(optarg);
+	case 'r':
+		return setprereadopts(optarg);
+	case 's':
+		return setspawnopts(optarg);
+	case 'P':
+		return setsourceopts(optarg);
+	case 'p':
+		fputs("Protocol specification unimplemented; using stream\n",
+		      stderr);
+		return false;
+	case 't':
+		if ((c = gettype(optarg)) < 0) {
+			fprintf(stderr, "Unsupported socket type '%s'\n",
+				optarg);
+			return true;
+		}
+		*(nservices > 0 ? &services[nservices - 1].type : &type) = c;
+		return false;
+	case 'w':
+		if (nservices == 0) {
+			fputs("Routes must follow the address of their "
+				"service\n", stderr);
+			return true;
+		}
+		return setroute(&services[nservices - 1], optarg);
+	case ':':
+		fprintf(stderr, "Option -%c requires an operand\n",
+			optopt);
+		return true;
+	default:
+		fprintf(stderr, "Unrecognized option '-%c'\n", optopt);
+		return true;
+	}
+}
+
+/*
+ * Return how many listeners a supervisor passed from LISTEN_FDS_START on, as
+ * told by LISTEN_FDS if LISTEN_PID is the process ID, or 0.  The variables
+ * are kept: workers have other process IDs, and an upgrade needs them.
+ */
+static int activated(void)
+{
+	const char * const pid = getenv("LISTEN_PID");
+	const char * const fds = getenv("LISTEN_FDS");
+	if (!pid || !fds)
+		return 0;
+	char *end;
+	errno = 0;
+	const unsigned long p = strtoul(pid, &end, 10);
+	if (*pid == 0 || *end || errno || p != (unsigned long) getpid())
+		return 0;
+	const unsigned long n = strtoul(fds, &end, 10);
+	return *fds == 0 || *end || errno || n > INT_MAX - LISTEN_FDS_START
+		? 0 : n;
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (2)))
+#endif
+static void argparse(const int argc, char * const argv[])
+{
+	assert(nservices == 0);
+	if (argc < 2) {
+		fputs("Missing operand\n", stderr);
+		usage(argc > 0 ? argv[0] : "serve");
+		exit(2);
+	}
+	atexit(cleanup);
+	int c;
+	bool error = false;
+	while ((c = getopt(argc, argv, ":A:a:b:c:d:e:f:H:l:m:n:O:o:P:p:q:R:r:s:t:w:")) != -1)
+		error |= processopt(c);
+	if (config && nservices > 0) {
+		fputs("Addresses cannot be given with a configuration file\n",
+		      stderr);
+		error = true;
+	}
+	const int nactivated = !config && nservices == 0 ? activated() : 0;
+	for (int i = 0; i < nactivated; i++) {
+		if (setaddressfd(LISTEN_FDS_START + i) < 0
+			|| addservice(&services, &nservices)) {
+			perror("Could not use socket passed by LISTEN_FDS");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (!config && nservices == 0 && (setaddressinet(NULL) < 0
+		|| addservice(&services, &nservices))) {
+		perror("Could not set default listening address");
+		exit(EXIT_FAILURE);
+	}
+	/* -e may follow -a */
+	for (size_t i = 0; i < nservices; i++) {
+		services[i].errormode = errormode;
+		services[i].errorfd = errorfd;
+	}
+	error |= checkadaptive();
+	/* requests are read while connections wait for data */
+	if (preread.enabled && deferoptions.timeout == 0)
+		deferoptions = (DeferOptions) {preread.timeout, 256};
+	/* either one command for all addresses or one for each */
+	const size_t ncommands = argc - optind;
+	if (config) {
+		if (ncommands > 0) {
+			fputs("Commands cannot be given with a configuration "
+				"file\n", stderr);
+			error = true;
+		}
+	} else if (ncommands == 0) {
+		fputs("Missing operand\n", stderr);
+		error = true;
+	} else if (ncommands > 1 && ncommands != nservices) {
+		fputs("Expected one operand or one per address\n", stderr);
+		error = true;
+	}
+	if (error) {
+		usage(argv[0]);
+		exit(2);
+	}
+	if (config && loadservices(&services, &nservices))
+		exit(EXIT_FAILURE);
+	for (size_t i = 0; !config && i < nservices; i++) {
+		const char * const cmd = argv[optind + (ncommands > 1 ? i : 0)];
+		if (!(services[i].command = strdup(cmd))) {
+			perror("Could not set command");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/*
+ * Run the command of route of service, or of service if route is SIZE_MAX,
+ * with environment envp.  Only async-signal-safe functions are called so that
+ * forked children of the multithreaded process can use it.
+ */
+void cmdexec(const size_t service, const size_t route, char * const envp[])
+{
+	assert(service < nservices);
+	const Service * const s = &services[service];
+	assert(route == SIZE_MAX || route < s->nroutes);
+	if (!shell) {
+		errno = ENOENT;
+		return;
+	}
+	char *argv[4] = {
+		"sh", "-c", route == SIZE_MAX ? s->command
+			: s->routes[route].command, NULL
+	};
+	execve(shell, argv, envp);
+}
+
+/*
+ * Choose the route of a connection to service whose first bytes are the n of
+ * buf, that is the first one matching them, or SIZE_MAX for the command of
+ * the service if none does.  Return true if more bytes could change the
+ * choice, leaving route alone, unless final.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (5)))
+#endif
+bool cmdroute(const size_t service, const char * const buf, const size_t n,
+	const bool final, size_t * const route)
+{
+	const Service * const s = &services[service];
+	for (size_t i = 0; i < s->nroutes; i++) {
+		const Route * const r = &s->routes[i];
+		size_t j = 0;
+		while (j < r->length && j < n
+			&& (r->any[j] || r->pattern[j] == buf[j]))
+			j++;
+		if (j == r->length) {
+			*route = i;
+			return false;
+		}
+		/* a route matching so far comes first if more bytes match */
+		if (j == n && !final)
+			return true;
+	}
+	*route = SIZE_MAX;
+	return false;
+}
+
+/* Open the listener of service.  Return true on failure. */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+static bool mklistener(Service * const service)
+{
+	assert(service->address != NULL);
+	if (service->type == SOCK_SEQPACKET
+		&& service->address->sa_family != AF_UNIX) {
+		fputs("Sequenced-packet sockets must have a unix address\n",
+			stderr);
+		return true;
+	}
+	const int listener = socket(service->address->sa_family,
+		service->type, service->protocol);
+	if ((service->listener = listener) < 0) {
+		perror("Could not create listener socket");
+		return true;
+	}
+	if (bind(listener, service->address, service->address_len) < 0) {
+		perror("Could not assign address to listener socket");
+		return true;
+	}
+	if (!mkcloexec(listener))
+		perror("Could not set listener socket descriptor flags");
+	sockoptsinit(service);
+	sockoptslisten(service);
+	/* datagram sockets receive without connections */
+	if (service->type != SOCK_DGRAM && listen(listener, SOMAXCONN) < 0) {
+		perror("Could not mark listener as accepting connections");
+		return true;
+	}
+	if (!mknonblocking(listener))
+		perror("Could not make listener socket nonblocking");
+	return false;
+}
+
+/*
+ * Set up the listener of service opened beforehand, making it listen unless
+ * it already does.  Return true on failure.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+static bool uselistener(Service * const service)
+{
+	const int listener = service->listener;
+	int type, listening = 0;
+	socklen_t len = sizeof type;
+	if (getsockopt(listener, SOL_SOCKET, SO_TYPE, &type, &len) < 0) {
+		perror("Could not use listener socket opened beforehand");
+		return true;
+	}
+	service->type = type;
+	sockoptsinit(service);
+	sockoptslisten(service);
+	len = sizeof listening;
+	if (type == SOCK_DGRAM
+		|| getsockopt(listener, SOL_SOCKET, SO_ACCEPTCONN, &listening,
+		&len) < 0)
+		listening = type == SOCK_DGRAM;
+	if (!listening && listen(listener, SOMAXCONN) < 0) {
+		perror("Could not mark listener as accepting connections");
+		return true;
+	}
+	if (!mkcloexec(listener))
+		perror("Could not set listener socket descriptor flags");
+	if (!mknonblocking(listener))
+		perror("Could not make listener socket nonblocking");
+	return false;
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2), pure))
+#endif
+static bool sameaddress(const Service * const a, const Service * const b)
+{
+	const struct sockaddr * const x = a->address, * const y = b->address;
+	if (a->type != b->type || x->sa_family != y->sa_family)
+		return false;
+	const struct sockaddr_in *x4, *y4;
+	const struct sockaddr_in6 *x6, *y6;
+	switch (x->sa_family) {
+	case AF_INET:
+		x4 = (const struct sockaddr_in *) x;
+		y4 = (const struct sockaddr_in *) y;
+		return x4->sin_port == y4->sin_port
+			&& x4->sin_addr.s_addr == y4->sin_addr.s_addr;
+	case AF_INET6:
+		x6 = (const struct sockaddr_in6 *) x;
+		y6 = (const struct sockaddr_in6 *) y;
+		return x6->sin6_port == y6->sin6_port
+			&& memcmp(&x6->sin6_addr, &y6->sin6_addr,
+				sizeof x6->sin6_addr) == 0;
+	case AF_UNIX:
+		return strcmp(((const struct sockaddr_un *) x)->sun_path,
+			((const struct sockaddr_un *) y)->sun_path) == 0;
+	default:
+		return false;
+	}
+}
+
+/* Drop the services read by cmdreload(), keeping the running ones. */
+void cmdabandon()
+{
+	/* listeners of running services have not been moved yet */
+	for (size_t i = 0; i < nfresh; i++) {
+		for (size_t j = 0; j < nservices; j++) {
+			if (fresh[i].listener == services[j].listener)
+				fresh[i].listener = -1;
+		}
+	}
+	freeservices(fresh, nfresh);
+	fresh = NULL;
+	nfresh = 0;
+}
+
+/*
+ * Read the configuration file again, without using it until cmdcommit().
+ * Services keep the listener of the running service with the same address
+ * and type, if any.  Return an array mapping the index of each running
+ * service to its new index, or SIZE_MAX if it is gone, setting n to the
+ * number of new services, or NULL with errno set on failure, in which case
+ * nothing changes.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+size_t *cmdreload(size_t * const n)
+{
+	if (!config) {
+		errno = ENOENT;
+		return NULL;
+	}
+	cmdabandon();
+	size_t * const map = malloc((nservices + 1) * sizeof *map);
+	if (!map || loadservices(&fresh, &nfresh)) {
+		cmdabandon();
+		free(map);
+		errno = EINVAL;
+		return NULL;
+	}
+	for (size_t i = 0; i < nservices; i++)
+		map[i] = SIZE_MAX;
+	for (size_t i = 0; i < nfresh; i++) {
+		if (fresh[i].listener >= 0 && uselistener(&fresh[i]))
+			goto failure;
+	}
+	for (size_t i = 0; i < nfresh; i++) {
+		size_t j = 0;
+		while (j < nservices && (map[j] != SIZE_MAX
+			|| !sameaddress(&services[j], &fresh[i])))
+			j++;
+		if (j < nservices) {
+			/* the running listener keeps its own options */
+			map[j] = i;
+			sockoptsinit(&fresh[i]);
+		} else if (fresh[i].listener < 0 && mklistener(&fresh[i]))
+			goto failure;
+	}
+	*n = nfresh;
+	return map;
+
+failure:
+	cmdabandon();
+	free(map);
+	errno = EINVAL;
+	return NULL;
+}
+
+/*
+ * Whether the routes of the running service old differ from those of the
+ * service read by cmdreload() that replaces it, fresh.
+ */
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+bool cmdrerouted(const size_t old, const size_t service)
+{
+	assert(old < nservices && service < nfresh);
+	const Service * const s = &services[old];
+	if (s->nroutes != fresh[service].nroutes)
+		return true;
+	for (size_t i = 0; i < s->nroutes; i++) {
+		const Route * const r = &s->routes[i];
+		const Route * const q = &fresh[service].routes[i];
+		if (r->length != q->length
+			|| memcmp(r->pattern, q->pattern, r->length) != 0
+			|| memcmp(r->any, q->any, r->length * sizeof *r->any)
+			!= 0 || strcmp(r->command, q->command) != 0)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Replace the running services by those read by cmdreload(), which returned
+ * map, closing the listeners of services gone.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+void cmdcommit(const size_t * const map)
+{
+	for (size_t j = 0; j < nservices; j++) {
+		if (map[j] != SIZE_MAX) {
+			fresh[map[j]].listener = services[j].listener;
+			services[j].listener = -1;
+		}
+	}
+	freeservices(services, nservices);
+	services = fresh;
+	nservices = nfresh;
+	fresh = NULL;
+	nfresh = 0;
+}
+
+/*
+ * Hand the listeners of the services of the previous process over to those
+ * with the same address and type, closing those no service takes.  Return
+ * true on failure.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+static bool adoptlisteners(FILE * const state)
+{
+	uintmax_t n;
+	if (stategetnum(state, &n) || n >= SIZE_MAX / sizeof *adopted
+		|| !(adopted = malloc((n + 1) * sizeof *adopted)))
+		return true;
+	for (nadopted = 0; nadopted < n; nadopted++) {
+		uintmax_t type;
+		size_t len;
+		int fd;
+		char *buf;
+		if (stategetnum(state, &type) || !(buf = stategetbytes(state,
+			&len)))
+			return true;
+		struct sockaddr_storage address = {0};
+		memcpy(&address, buf, len < sizeof address ? len
+			: sizeof address);
+		free(buf);
+		const Service old = {
+			.address = (struct sockaddr *) &address,
+			.type = type
+		};
+		if (stategetfd(state, &fd))
+			return true;
+		/* descriptors given as addresses are simply kept */
+		size_t i = 0;
+		while (i < nservices && !(fd >= 0 && services[i].listener == fd)
+			&& (services[i].listener >= 0
+			|| !sameaddress(&services[i], &old)))
+			i++;
+		adopted[nadopted] = i < nservices ? i : SIZE_MAX;
+		if (i < nservices)
+			services[i].listener = fd;
+		else if (fd >= 0)
+			close(fd);
+	}
+	return false;
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (2)))
+#endif
+static void setlocaletype(int type, const char * const restrict str)
+{
+	const char *env = getenv(str);
+	if (env && !setlocale(type, env)) {
+		fprintf(stderr, "Could not set %s to %s\n", str, env);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Search $PATH, or the usual directories if it is unset, for sh like execvp()
+ * would, but once at startup since workers must not do it after fork().
+ * Return its path, or NULL with errno set if it is missing or on failure.
+ */
+static char *findshell()
+{
+	const char *path = getenv("PATH");
+	if (!path)
+		path = "/bin:/usr/bin";
+	for (;;) {
+		/* an empty entry is the working directory */
+		const size_t n = strcspn(path, ":");
+		char * const sh = malloc(n + sizeof "./sh");
+		if (!sh)
+			return NULL;
+		if (n == 0)
+			strcpy(sh, "./sh");
+		else {
+			memcpy(sh, path, n);
+			strcpy(sh + n, "/sh");
+		}
+		if (access(sh, X_OK) == 0)
+			return sh;
+		free(sh);
+		if (path[n] == '\0')
+			break;
+		path += n + 1;
+	}
+	errno = ENOENT;
+	return NULL;
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (2)))
+#endif
+void init(const int argc, char * const argv[])
+{
+	setlocaletype(LC_ALL, "LANG");
+	setlocaletype(LC_COLLATE, "LC_COLLATE");
+	setlocaletype(LC_CTYPE, "LC_CTYPE");
+	setlocaletype(LC_NUMERIC, "LC_NUMERIC");
+	setlocaletype(LC_ALL, "LC_ALL");
+	argparse(argc, argv);
+	/* a missing shell only makes every worker fail to start */
+	if (!(shell = findshell()) && errno != ENOENT) {
+		perror("Could not find the shell");
+		exit(EXIT_FAILURE);
+	}
+	FILE * const state = stateinherited();
+	if (state && adoptlisteners(state)) {
+		fprintf(stderr, "Could not read the listeners of the previous "
+			"process\n");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < nservices; i++) {
+		if (services[i].listener < 0 ? mklistener(&services[i])
+			: uselistener(&services[i]))
+			exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Return the index of the service matching service of the process this one
+ * replaced, or SIZE_MAX if there is none.
+ */
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+size_t cmdadopted(const size_t service)
+{
+	return service < nadopted ? adopted[service] : SIZE_MAX;
+}
+
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+size_t getnservices()
+{
+	return nservices;
+}
+
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+const Service *getservice(const size_t i)
+{
+	return &services[i];
+}
+
+#ifdef __GNUC__
+__attribute__((const))
+#endif
+const LogOptions *getlogoptions()
+{
+	return &logoptions;
+}
+
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+uint_fast32_t getmaxsessions()
+{
+	return maxsessions;
+}
+
+#ifdef __GNUC__
+__attribute__((const))
+#endif
+const SourceLimits *getsourcelimits()
+{
+	return &sourcelimits;
+}
+
+#ifdef __GNUC__
+__attribute__((const))
+#endif
+const OverloadPolicy *getoverload()
+{
+	return &overload;
+}
+
+#ifdef __GNUC__
+__attribute__((const))
+#endif
+const AdaptiveLimit *getadaptive()
+{
+	return &adaptive;
+}
+
+#ifdef __GNUC__
+__attribute__((const))
+#endif
+const QueueOptions *getqueueoptions()
+{
+	return &queueoptions;
+}
+
+#ifdef __GNUC__
+__attribute__((const))
+#endif
+const SpawnLimit *getspawnlimit()
+{
+	return &spawnlimit;
+}
+
+#ifdef __GNUC__
+__attribute__((const))
+#endif
+const BreakerOptions *getbreaker()
+{
+	return &breaker;
+}
+
+#ifdef __GNUC__
+__attribute__((const))
+#endif
+const DeferOptions *getdeferoptions()
+{
+	return &deferoptions;
+}
+
+#ifdef __GNUC__
+__attribute__((const))
+#endif
+const PrereadOptions *getpreread()
+{
+	return &preread;
+}
+
+#ifdef __GNUC__
+__attribute__((const))
+#endif
+const WorkerLimits *getworkerlimits()
+{
+	return &workerlimits;
+}
+
+/* configuration file of the services, or NULL */
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+const char *getconfig()
+{
+	return config;
+}
+
+/* control socket path for backends to register at, or NULL */
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+const char *gethandoff()
+{
+	return handoff;
 }
 
 #ifdef __GNUC__
 __attribute__((const))
 #endif
-int getlistener()
+const DatagramOptions *getdatagram()
 {
-	return listener;
+	return &datagram;
 }
@@ -15,15 +15,334 @@
  * You should have received a copy of the GNU General Public License along with
  * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
  */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* longest pattern of a route, and so most bytes peeked to choose one */
+#define ROUTE_MAX 256
+/* milliseconds connections wait for their route without the -d option */
+#define ROUTE_TIMEOUT 1000
+
+/*
+ * Command run on the connections whose first length bytes match pattern,
+ * except where any is set since those match any byte.
+ */
+typedef struct {
+	char *pattern, *command;
+	bool *any;
+	size_t length;
+} Route;
+
+/*
+ * Options set on sockets, each unset if zero: whether Nagle's algorithm is
+ * disabled and acknowledgements are sent at once, buffer sizes in bytes, the
+ * TCP Fast Open queue length, the keepalive idle time and interval in seconds
+ * with the number of probes, the busy polling time in microseconds, then the
+ * linger time in seconds if setlinger is set.
+ */
+typedef struct {
+	uint_fast32_t nodelay, quickack, sndbuf, rcvbuf, fastopen;
+	uint_fast32_t keepidle, keepintvl, keepcnt, busypoll;
+	bool setlinger;
+	uint_fast32_t linger;
+} SocketOptions;
+
+/* call of setsockopt() setting the option key to value */
+typedef struct {
+	int level, name, value;
+	const char *key;
+} SocketOption;
+
+/*
+ * Calls made on sockets of a service, built once from its SocketOptions by
+ * sockoptsinit().  Options of listeners are either needed before connections
+ * arrive or inherited by accepted sockets.
+ */
+typedef struct {
+	SocketOption listening[4], accepted[6];
+	size_t nlistening, naccepted;
+	struct linger linger;
+} SocketCalls;
+
+/*
+ * Listening socket and the command run on its connections, of which at most
+ * maxsessions run at once if not zero.  Connections matching one of the
+ * nroutes routes run its command instead.  The standard error of its workers
+ * is handled according to errormode, going to errorfd in ERRORS_DIRECT mode.
+ * Its listener and connections get the socket options sockopts, set by the
+ * calls of sockcalls.
+ */
+typedef struct {
+	struct sockaddr *address;
+	socklen_t address_len;
+	int type, protocol, listener;
+	char *command;
+	Route *routes;
+	size_t nroutes;
+	uint_fast32_t maxsessions;
+	int errormode, errorfd;
+	SocketOptions sockopts;
+	SocketCalls sockcalls;
+} Service;
+
+/* clocks prefixed to log lines */
+enum {LOG_WALL = 1, LOG_MONOTONIC = 2};
+
+/*
+ * Rates are in lines or bytes per second, zero meaning unlimited.  Without a
+ * file, the log goes to standard output and is never rotated.
+ */
+typedef struct {
+	uint_fast32_t lines, bytes, totallines, totalbytes;
+	char *file;
+	uint_fast32_t size, age, keep, buffer;
+	int clocks;
+	uint_fast32_t precision;
+} LogOptions;
+
+/* limits per peer address, zero meaning unlimited */
+typedef struct {
+	uint_fast32_t sessions, rate, burst;
+} SourceLimits;
+
+/*
+ * Shed connections, sending them reply, when the maximum number of sessions is
+ * reached if full is set, or when load or backlog thresholds are met.
+ */
+typedef struct {
+	char *reply;
+	size_t length;
+	bool full;
+	double load;
+	uint_fast32_t backlog;
+} OverloadPolicy;
+
+/*
+ * Adaptive limit on simultaneous sessions, between min and max, where
+ * tolerance is the percentage by which session durations may grow before
+ * the limit is cut.
+ */
+typedef struct {
+	bool enabled;
+	uint_fast32_t initial, min, max, tolerance;
+} AdaptiveLimit;
+
+/* rate of worker process creation per second and burst, zero if unlimited */
+typedef struct {
+	uint_fast32_t rate, burst;
+} SpawnLimit;
+
+/*
+ * Circuit breaker opening when ratio percent of the last window sessions
+ * failed within lifetime milliseconds, probing every probe milliseconds.
+ * The breaker is disabled if window is zero.
+ */
+typedef struct {
+	uint_fast32_t window, ratio, lifetime, probe;
+} BreakerOptions;
+
+/*
+ * Connections not closed nor having sent data within timeout milliseconds,
+ * up to size of them at once, do not get a session.  Disabled if timeout is
+ * zero.
+ */
+typedef struct {
+	uint_fast32_t timeout, size;
+} DeferOptions;
+
+/*
+ * Requests read before their session starts, until delimiter is received,
+ * length bytes are or timeout milliseconds elapse, whichever comes first.
+ */
+typedef struct {
+	bool enabled;
+	char *delimiter;
+	size_t delimlength;
+	uint_fast32_t length, timeout;
+} PrereadOptions;
+
+/* I/O scheduling classes of worker processes, where supported */
+enum {IOCLASS_NONE, IOCLASS_REALTIME, IOCLASS_BESTEFFORT, IOCLASS_IDLE};
+
+/*
+ * Resource limits of worker processes, each unset if zero: CPU time in
+ * seconds, address space in mebibytes and open files, then the nice value if
+ * setnice is set, and the I/O scheduling class with its level from 0 to 7.
+ */
+typedef struct {
+	uint_fast32_t cpu, as, nofile;
+	bool setnice;
+	int nice, ioclass;
+	uint_fast32_t iolevel;
+} WorkerLimits;
+
+/*
+ * Queue of up to size connections waiting for a session, for at most timeout
+ * milliseconds if not zero, sent the overload reply on expiry if reply is set.
+ */
+typedef struct {
+	uint_fast32_t size, timeout;
+	bool reply;
+} QueueOptions;
+
+/* how datagrams are given to worker processes */
+enum {DGRAM_EACH, DGRAM_BATCH, DGRAM_PEER};
+
+/*
+ * Datagrams of up to size bytes are received and replies are sent batch at a
+ * time.  In DGRAM_EACH mode, each datagram gets its own worker, and in
+ * DGRAM_BATCH mode, the datagrams received at once share one.  In DGRAM_PEER
+ * mode, each peer gets a worker that lasts until the peer stays silent for
+ * idle milliseconds.
+ */
+typedef struct {
+	int mode;
+	uint_fast32_t batch, size, idle;
+} DatagramOptions;
+
 void init(int argc, char * const argv[])
 #ifdef __GNUC__
 __attribute__((nonnull (2)))
 #endif
 ;
 
-void cmdexec(void);
+void cmdexec(size_t service, size_t route, char * const envp[])
+#ifdef __GNUC__
+__attribute__((nonnull (3)))
+#endif
+;
+
+bool cmdroute(size_t service, const char *buf, size_t n, bool final,
+	size_t *route)
+#ifdef __GNUC__
+__attribute__((nonnull (5)))
+#endif
+;
+
+size_t getnservices(void)
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+;
+
+const Service *getservice(size_t i)
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+;
+
+/* Return how indices of services moved by a reload, or NULL on failure. */
+size_t *cmdreload(size_t *n)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+bool cmdrerouted(size_t old, size_t service)
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+;
+
+void cmdcommit(const size_t *map)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+void cmdabandon(void);
+
+size_t cmdadopted(size_t service)
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+;
+
+const LogOptions *getlogoptions(void)
+#ifdef __GNUC__
+__attribute__((const))
+#endif
+;
+
+/* what becomes of the standard error of workers */
+enum {ERRORS_PREFIX, ERRORS_RAW, ERRORS_DIRECT};
+
+/* maximum number of simultaneous sessions, or 0 if unlimited */
+uint_fast32_t getmaxsessions(void)
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+;
+
+const SourceLimits *getsourcelimits(void)
+#ifdef __GNUC__
+__attribute__((const))
+#endif
+;
+
+const OverloadPolicy *getoverload(void)
+#ifdef __GNUC__
+__attribute__((const))
+#endif
+;
+
+const AdaptiveLimit *getadaptive(void)
+#ifdef __GNUC__
+__attribute__((const))
+#endif
+;
+
+const QueueOptions *getqueueoptions(void)
+#ifdef __GNUC__
+__attribute__((const))
+#endif
+;
+
+const SpawnLimit *getspawnlimit(void)
+#ifdef __GNUC__
+__attribute__((const))
+#endif
+;
+
+const BreakerOptions *getbreaker(void)
+#ifdef __GNUC__
+__attribute__((const))
+#endif
+;
+
+const DeferOptions *getdeferoptions(void)
+#ifdef __GNUC__
+__attribute__((const))
+#endif
+;
+
+const PrereadOptions *getpreread(void)
+#ifdef __GNUC__
+__attribute__((const))
+#endif
+;
+
+const WorkerLimits *getworkerlimits(void)
+#ifdef __GNUC__
+__attribute__((const))
+#endif
+;
+
+const char *getconfig(void)
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+;
+
+const char *gethandoff(void)
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+;
 
-int getlistener(void)
+const DatagramOptions *getdatagram(void)
 #ifdef __GNUC__
 __attribute__((const))
 #endif
@@ -0,0 +1,592 @@
+/*
+ * Copyright (C) 2023 Pierre Colin
+ * This file is part of the serve utility.
+ * 
+ * The serve utility is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * The serve utility is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifdef __linux__
+/* for TCP_DEFER_ACCEPT and F_ADD_SEALS */
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "command.h"
+#include "log.h"
+#include "metrics.h"
+#include "remote.h"
+#include "queue.h"
+#include "defer.h"
+#include "sources.h"
+#include "state.h"
+
+/* milliseconds between peeks at connections with too few bytes for a route */
+#define REPEEK_PERIOD 10
+/* connections that may wait for their route at once without the -d option */
+#define ROUTE_WAITING 256
+
+/*
+ * Accepted connections waiting for their first bytes of data, or for their
+ * whole request if it is pre-read into buf, in no particular order.  Their
+ * poll events are kept alongside since the entries of fds following worker
+ * processes are overwritten as workers come and go.  Connections that sent
+ * too few bytes to choose their route are partial: as they would always be
+ * readable, they are peeked at again periodically instead of polled.  Those
+ * ready while their service can neither start nor queue a session are
+ * blocked, waiting unpolled and without timeout as in the backlog of their
+ * listener, their route chosen and their request, if pre-read, in input.
+ */
+typedef struct {
+	Pending pending;
+	short revents;
+	bool partial, blocked;
+	char *buf;
+	size_t n, size;
+} Deferred;
+
+static Deferred *set;
+static size_t length, capacity;
+
+static void cleanup(void)
+{
+	for (size_t i = 0; i < length; i++) {
+		close(set[i].pending.sock);
+		if (set[i].pending.input >= 0)
+			close(set[i].pending.input);
+		free(set[i].pending.remote);
+		free(set[i].buf);
+	}
+	free(set);
+}
+
+/*
+ * Make room for as many connections as the -d option lets wait, or for those
+ * waiting for their route if services have routes or may gain some on
+ * reload.
+ */
+bool deferinit(void)
+{
+	const DeferOptions * const opts = getdeferoptions();
+	bool routed = getconfig() != NULL;
+	for (size_t i = 0; !routed && i < getnservices(); i++)
+		routed = getservice(i)->nroutes > 0;
+	const size_t size = opts->timeout > 0 ? opts->size
+		: routed ? ROUTE_WAITING : 0;
+	if (size == 0)
+		return false;
+	if (!(set = malloc(size * sizeof *set)))
+		return true;
+	capacity = size;
+	atexit(cleanup);
+	return false;
+}
+
+/* How many connections may wait at once. */
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+size_t defersize()
+{
+	return capacity;
+}
+
+/*
+ * Return how many milliseconds connections to service may wait for data, or
+ * zero if they are not to.  Connections to services with routes wait for
+ * enough bytes to choose one even without the -d option.
+ */
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+uint_fast32_t deferwait(const size_t service)
+{
+	const uint_fast32_t timeout = getdeferoptions()->timeout;
+	return timeout == 0 && getservice(service)->nroutes > 0
+		? ROUTE_TIMEOUT : timeout;
+}
+
+/*
+ * Have the kernel hold TCP connections to service until they carry data where
+ * it can.  Connections it hands over anyway once the timeout elapses are still
+ * checked by deferpeek().  Connections of services with routes are not held
+ * since those sending nothing take the command of the service on timeout.
+ */
+void deferlisten(const size_t service)
+{
+#if defined(__linux__) && defined(TCP_DEFER_ACCEPT)
+	const uint_fast32_t timeout = getdeferoptions()->timeout;
+	if (timeout == 0)
+		return;
+	const Service * const s = getservice(service);
+	const int seconds = s->nroutes > 0 ? 0 : (timeout + 999) / 1000;
+	/* fails harmlessly on sockets other than TCP ones */
+	(void) setsockopt(s->listener, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds,
+		sizeof seconds);
+#else
+	(void) service;
+#endif
+}
+
+/*
+ * Return about how many milliseconds the kernel held a connection to service
+ * that it handed over without data, as deferlisten() has it do, so that the
+ * wait for data does not start over.  The kernel only tells the value it
+ * rounds up to whole retransmissions of the handshake, and may hand over
+ * connections early, so this is an estimate capped at the timeout.
+ */
+uint_fast64_t deferheld(const size_t service)
+{
+#if defined(__linux__) && defined(TCP_DEFER_ACCEPT)
+	int seconds;
+	socklen_t len = sizeof seconds;
+	if (getsockopt(getservice(service)->listener, IPPROTO_TCP,
+		TCP_DEFER_ACCEPT, &seconds, &len) < 0 || seconds <= 0)
+		return 0;
+	const uint_fast64_t held = (uint_fast64_t) seconds * 1000;
+	const uint_fast32_t timeout = getdeferoptions()->timeout;
+	return held < timeout ? held : timeout;
+#else
+	(void) service;
+	return 0;
+#endif
+}
+
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+size_t deferlength()
+{
+	return length;
+}
+
+/*
+ * Whether the requests of connections of service are pre-read.  Packets of
+ * sequenced-packet connections are left to their worker, as reading them
+ * into one file would lose their boundaries.
+ */
+bool deferprereads(const size_t service)
+{
+	return getpreread()->enabled
+		&& getservice(service)->type != SOCK_SEQPACKET;
+}
+
+/*
+ * Return 1 if data is available on sock, 0 if none arrived yet and -1 if the
+ * connection was closed without sending any.
+ */
+int deferpeek(const int sock)
+{
+	char c;
+	const ssize_t n = recv(sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	if (n > 0)
+		return 1;
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK
+		|| errno == EINTR))
+		return 0;
+	return -1;
+}
+
+/*
+ * Choose the route of sock, a connection to service, by peeking at its first
+ * bytes, and at those alone if final.  Return 1 if chosen, 0 if more bytes are
+ * to come and -1 if the connection was closed without sending any.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (4)))
+#endif
+int deferroute(const int sock, const size_t service, const bool final,
+	size_t * const route)
+{
+	char buf[ROUTE_MAX];
+	const ssize_t n = recv(sock, buf, sizeof buf, MSG_PEEK | MSG_DONTWAIT);
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+		&& errno != EINTR))
+		return -1;
+	return !cmdroute(service, buf, n < 0 ? 0 : n, final, route);
+}
+
+/*
+ * Choose again the route of pending, a connection waiting for a session,
+ * once the routes of its service changed, from its pre-read request or from
+ * the bytes it sent so far.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+void deferreroute(Pending * const pending)
+{
+	pending->route = SIZE_MAX;
+	if (pending->input < 0) {
+		(void) deferroute(pending->sock, pending->service, true,
+			&pending->route);
+		return;
+	}
+	char buf[ROUTE_MAX];
+	const ssize_t n = pread(pending->input, buf, sizeof buf, 0);
+	(void) cmdroute(pending->service, buf, n < 0 ? 0 : n, true,
+		&pending->route);
+}
+
+static void discard(const size_t i)
+{
+	close(set[i].pending.sock);
+	if (set[i].pending.input >= 0)
+		close(set[i].pending.input);
+	free(set[i].pending.remote);
+	free(set[i].buf);
+	sourcerelease(&set[i].pending.source);
+	set[i] = set[--length];
+	gauges[GAUGE_DEFERRED] = length;
+}
+
+static void drop(const size_t i)
+{
+	discard(i);
+	counters[COUNT_IDLE]++;
+}
+
+/*
+ * Renumber the services of waiting connections after a reload, closing those
+ * whose service is gone and choosing again the route of blocked ones whose
+ * service is rerouted.  Return how many were closed.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2)))
+#endif
+size_t deferremap(const size_t * const map, const bool * const rerouted)
+{
+	size_t closed = 0;
+	for (size_t i = 0; i < length; /* noop */) {
+		size_t * const service = &set[i].pending.service;
+		if ((*service = map[*service]) != SIZE_MAX) {
+			if (set[i].blocked && rerouted[*service])
+				deferreroute(&set[i].pending);
+			i++;
+		} else {
+			discard(i);
+			closed++;
+		}
+	}
+	return closed;
+}
+
+/* Add a connection, making room by dropping the oldest one if needed. */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+void deferpush(const Pending * const pending)
+{
+	if (length == capacity) {
+		size_t oldest = 0;
+		for (size_t i = 1; i < length; i++) {
+			if (set[i].pending.since < set[oldest].pending.since)
+				oldest = i;
+		}
+		drop(oldest);
+	}
+	set[length].pending = *pending;
+	set[length].revents = 0;
+	set[length].partial = set[length].blocked = false;
+	set[length].buf = NULL;
+	set[length].n = set[length].size = 0;
+	length++;
+	counters[COUNT_DEFERRED]++;
+	gauges[GAUGE_DEFERRED] = length;
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+void defersave(FILE * const state)
+{
+	stateputnum(state, length);
+	for (size_t i = 0; i < length; i++) {
+		pendingsave(state, &set[i].pending);
+		stateputbytes(state, set[i].buf, set[i].n);
+	}
+}
+
+/*
+ * Read the connections left waiting by the previous process, closing those
+ * that do not fit or whose service is gone.  Return true on failure.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+bool deferload(FILE * const state, const uint_fast64_t now)
+{
+	uintmax_t n;
+	if (stategetnum(state, &n))
+		return true;
+	for (uintmax_t i = 0; i < n; i++) {
+		Deferred d = {.revents = 0};
+		if (pendingload(state, &d.pending, now))
+			return true;
+		if (!(d.buf = stategetbytes(state, &d.n))) {
+			close(d.pending.sock);
+			if (d.pending.input >= 0)
+				close(d.pending.input);
+			free(d.pending.remote);
+			sourcerelease(&d.pending.source);
+			return true;
+		}
+		d.size = d.n;
+		/* only blocked connections have their request stored */
+		d.blocked = d.pending.input >= 0;
+		if (d.pending.service != SIZE_MAX && length < capacity) {
+			set[length++] = d;
+			continue;
+		}
+		close(d.pending.sock);
+		if (d.pending.input >= 0)
+			close(d.pending.input);
+		free(d.pending.remote);
+		free(d.buf);
+		sourcerelease(&d.pending.source);
+	}
+	gauges[GAUGE_DEFERRED] = length;
+	return false;
+}
+
+/* Fill deferlength() entries of fds to poll the connections. */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+void deferpoll(struct pollfd * const fds)
+{
+	for (size_t i = 0; i < length; i++) {
+		fds[i].fd = set[i].partial || set[i].blocked ? -1
+			: set[i].pending.sock;
+		fds[i].events = POLLIN;
+		fds[i].revents = 0;
+	}
+}
+
+/* Save the events of entries filled by deferpoll(), returning their count. */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+int deferrevents(const struct pollfd * const fds)
+{
+	int n = 0;
+	for (size_t i = 0; i < length; i++)
+		n += (set[i].revents = fds[i].revents) != 0;
+	return n;
+}
+
+/* Whether the delimiter ends within the bytes of d from index from. */
+#ifdef __GNUC__
+__attribute__((nonnull (1), pure))
+#endif
+static bool delimited(const Deferred * const d, size_t from)
+{
+	const PrereadOptions * const opts = getpreread();
+	const size_t len = opts->delimlength;
+	if (len == 0 || d->n < len)
+		return false;
+	from = from >= len ? from - len + 1 : 0;
+	for (size_t i = from; i + len <= d->n; i++) {
+		if (memcmp(d->buf + i, opts->delimiter, len) == 0)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Read what d has sent so far.  Return 1 if the request is complete, 0 if
+ * more is to come and -1 if the connection failed or closed without sending
+ * anything.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+static int readrequest(Deferred * const d)
+{
+	const size_t max = getpreread()->length;
+	while (d->n < max) {
+		if (d->n == d->size) {
+			size_t size = d->size == 0 ? 512 : 2 * d->size;
+			if (size > max)
+				size = max;
+			char * const buf = realloc(d->buf, size);
+			if (!buf)
+				return -1;
+			d->buf = buf;
+			d->size = size;
+		}
+		const ssize_t r = recv(d->pending.sock, d->buf + d->n,
+			d->size - d->n, MSG_DONTWAIT);
+		if (r == 0)
+			return d->n > 0 ? 1 : -1;
+		if (r < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK
+				|| errno == EINTR ? 0 : -1;
+		d->n += r;
+		if (delimited(d, d->n - r))
+			return 1;
+	}
+	return 1;
+}
+
+/* Return a sealed read-only file holding the request of d, or -1. */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+static int mkinput(const Deferred * const d)
+{
+	const int fd = mkanonfile("request");
+	if (fd < 0)
+		return -1;
+	for (size_t off = 0; off < d->n; /* noop */) {
+		const ssize_t w = write(fd, d->buf + off, d->n - off);
+		if (w < 0)
+			goto failure;
+		off += w;
+	}
+	if (lseek(fd, 0, SEEK_SET) < 0)
+		goto failure;
+#if defined(__linux__) && defined(F_ADD_SEALS)
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE
+		| F_SEAL_SEAL) < 0)
+		goto failure;
+#endif
+	return fd;
+
+failure:;
+	const int e = errno;
+	close(fd);
+	errno = e;
+	return -1;
+}
+
+/*
+ * Remove a connection that sent data, or its whole request if pre-read, into
+ * pending and return true, or return false if none did.  Connections closed
+ * or having waited too long without sending anything are dropped along the
+ * way.  A pre-read request is cut short by its timeout.  Connections ready
+ * for which blocked returns true are kept until it no longer does.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1, 3)))
+#endif
+bool deferready(Pending * const pending, const uint_fast64_t now,
+	bool (* const blocked)(const Pending *))
+{
+	const PrereadOptions * const opts = getpreread();
+	for (size_t i = 0; i < length; /* noop */) {
+		Deferred * const d = &set[i];
+		Pending * const p = &d->pending;
+		const bool whole = deferprereads(p->service);
+		if (!d->blocked) {
+			const uint_fast64_t waited = now - p->since;
+			const uint_fast32_t timeout = deferwait(p->service);
+			const bool routed = getservice(p->service)->nroutes > 0;
+			/* services may have lost their routes on reload */
+			int r = timeout == 0 ? 1
+				: !d->revents && !d->partial ? 0
+				: whole ? readrequest(d)
+				: routed ? deferroute(p->sock, p->service,
+				false, &p->route)
+				: deferpeek(p->sock);
+			if (r == 0 && d->n > 0 && waited >= opts->timeout)
+				r = 1;
+			/* connections of protocols where servers speak first */
+			if (r == 0 && d->n == 0 && waited >= timeout)
+				r = routed && !whole ? deferroute(p->sock,
+					p->service, true, &p->route) : -1;
+			if (r > 0 && whole)
+				(void) cmdroute(p->service, d->buf, d->n, true,
+					&p->route);
+			if (r > 0 && whole && (p->input = mkinput(d)) < 0) {
+				fprintf(stderr,
+					"Could not store request (%s): %s\n",
+					p->remote, strerror(errno));
+				discard(i);
+				continue;
+			}
+			if (r < 0) {
+				logprintf("Connection closed (%s): no data\n",
+					p->remote);
+				drop(i);
+				continue;
+			}
+			d->partial = r == 0 && routed && !whole
+				&& (d->partial || d->revents & POLLIN);
+			d->revents = 0;
+			if (r == 0) {
+				i++;
+				continue;
+			}
+		}
+		if ((d->blocked = blocked(p))) {
+			i++;
+			continue;
+		}
+		*pending = *p;
+		free(d->buf);
+		*d = set[--length];
+		gauges[GAUGE_DEFERRED] = length;
+		counters[COUNT_PREREAD] += whole;
+		return true;
+	}
+	return false;
+}
+
+/* How many connections are ready but blocked by deferready(). */
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+size_t deferblocked()
+{
+	size_t n = 0;
+	for (size_t i = 0; i < length; i++)
+		n += set[i].blocked;
+	return n;
+}
+
+/*
+ * milliseconds until a connection waited too long for data, or for the rest
+ * of its pre-read request, or -1
+ */
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+int defertimeout(const uint_fast64_t now)
+{
+	const uint_fast32_t request = getpreread()->timeout;
+	int timeout = -1;
+	for (size_t i = 0; i < length; i++) {
+		if (set[i].blocked)
+			continue;
+		const uint_fast64_t end = set[i].pending.since + (set[i].n > 0
+			? request : deferwait(set[i].pending.service));
+		int left = end > now ? end - now : 0;
+		if (set[i].partial && left > REPEEK_PERIOD)
+			left = REPEEK_PERIOD;
+		if (timeout < 0 || left < timeout)
+			timeout = left;
+	}
+	return timeout;
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2023 Pierre Colin
+ * This file is part of the serve utility.
+ * 
+ * The serve utility is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * The serve utility is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Pending is declared in queue.h */
+
+bool deferinit(void);
+
+size_t defersize(void)
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+;
+
+uint_fast32_t deferwait(size_t service)
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+;
+
+void deferlisten(size_t service);
+
+uint_fast64_t deferheld(size_t service);
+
+size_t deferlength(void)
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+;
+
+int deferpeek(int sock);
+
+bool deferprereads(size_t service);
+
+int deferroute(int sock, size_t service, bool final, size_t *route)
+#ifdef __GNUC__
+__attribute__((nonnull (4)))
+#endif
+;
+
+void deferreroute(Pending *pending)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+size_t deferremap(const size_t *map, const bool *rerouted)
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2)))
+#endif
+;
+
+void deferpush(const Pending *pending)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+void defersave(FILE *state)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+bool deferload(FILE *state, uint_fast64_t now)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+void deferpoll(struct pollfd *fds)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+int deferrevents(const struct pollfd *fds)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+bool deferready(Pending *pending, uint_fast64_t now,
+	bool (*blocked)(const Pending *))
+#ifdef __GNUC__
+__attribute__((nonnull (1, 3)))
+#endif
+;
+
+size_t deferblocked(void)
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+;
+
+int defertimeout(uint_fast64_t now)
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+;
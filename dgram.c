@@ -0,0 +1,516 @@
+/*
+ * Copyright (C) 2023 Pierre Colin
+ * This file is part of the serve utility.
+ * 
+ * The serve utility is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * The serve utility is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifdef __linux__
+/* for recvmmsg(), sendmmsg() and F_ADD_SEALS */
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "command.h"
+#include "metrics.h"
+#include "remote.h"
+#include "dgram.h"
+#include "state.h"
+
+/*
+ * Worker process given datagrams from peers, which are sent what it writes to
+ * output once it exits.  Free entries have an output of -1.
+ */
+typedef struct {
+	int output;
+	Peer *peers;
+	size_t npeers;
+} Job;
+
+typedef struct {
+	int listener;
+	Peer peer;
+	char *data;
+	size_t length;
+} Reply;
+
+/* datagrams from the last call to dgramreceive() and their peers */
+static char *buffers;
+static size_t *lengths;
+static Peer *received;
+static size_t nreceived;
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+static struct mmsghdr *msgs;
+#endif
+static struct iovec *iovs;
+
+static Job *jobs;
+static size_t njobs;
+/* replies waiting for dgramflush() */
+static Reply *replies;
+static size_t nreplies, creplies;
+
+static void cleanup(void)
+{
+	for (size_t i = 0; i < njobs; i++) {
+		if (jobs[i].output >= 0)
+			close(jobs[i].output);
+		free(jobs[i].peers);
+	}
+	for (size_t i = 0; i < nreplies; i++)
+		free(replies[i].data);
+	free(jobs);
+	free(replies);
+	free(buffers);
+	free(lengths);
+	free(received);
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+	free(msgs);
+#endif
+	free(iovs);
+}
+
+static bool setup(void)
+{
+	static bool done = false;
+	if (done)
+		return false;
+	const DatagramOptions * const opts = getdatagram();
+	const size_t n = opts->batch;
+	if (!(buffers = malloc(n * opts->size))
+		|| !(lengths = malloc(n * sizeof *lengths))
+		|| !(received = malloc(n * sizeof *received))
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+		|| !(msgs = malloc(n * sizeof *msgs))
+#endif
+		|| !(iovs = malloc(n * sizeof *iovs)))
+		return true;
+	atexit(cleanup);
+	done = true;
+	return false;
+}
+
+/*
+ * Keep datagram i of length bytes as the next one received, unless it was cut
+ * short by the buffer size, since workers would take it as whole.
+ */
+static void keep(const size_t i, const size_t length, const bool truncated)
+{
+	const size_t size = getdatagram()->size;
+	if (truncated) {
+		counters[COUNT_TRUNCATED]++;
+		return;
+	}
+	if (i != nreceived) {
+		memcpy(buffers + nreceived * size, buffers + i * size, length);
+		received[nreceived] = received[i];
+	}
+	lengths[nreceived++] = length;
+}
+
+/*
+ * Receive up to max datagrams, and at most the configured batch, without
+ * waiting.  Return how many were received and not truncated, or -1 if none
+ * could be.
+ */
+int dgramreceive(const int listener, size_t max)
+{
+	const DatagramOptions * const opts = getdatagram();
+	if (setup())
+		return -1;
+	if (max > opts->batch)
+		max = opts->batch;
+	memset(received, 0, max * sizeof *received);
+	nreceived = 0;
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+	for (size_t i = 0; i < max; i++) {
+		iovs[i].iov_base = buffers + i * opts->size;
+		iovs[i].iov_len = opts->size;
+		msgs[i].msg_hdr = (struct msghdr) {
+			.msg_name = &received[i].address,
+			.msg_namelen = sizeof received[i].address,
+			.msg_iov = &iovs[i],
+			.msg_iovlen = 1
+		};
+	}
+	const int n = recvmmsg(listener, msgs, max, MSG_DONTWAIT, NULL);
+	if (n < 0)
+		return -1;
+	for (int i = 0; i < n; i++) {
+		received[i].length = msgs[i].msg_hdr.msg_namelen;
+		keep(i, msgs[i].msg_len, msgs[i].msg_hdr.msg_flags & MSG_TRUNC);
+	}
+#else
+	for (size_t i = 0; i < max; i++) {
+		Peer * const peer = &received[nreceived];
+		struct iovec iov = {
+			buffers + nreceived * opts->size, opts->size
+		};
+		struct msghdr msg = {
+			.msg_name = &peer->address,
+			.msg_namelen = sizeof peer->address,
+			.msg_iov = &iov,
+			.msg_iovlen = 1
+		};
+		const ssize_t r = recvmsg(listener, &msg, 0);
+		if (r < 0 && i == 0)
+			return -1;
+		if (r < 0)
+			break;
+		peer->length = msg.msg_namelen;
+		keep(nreceived, r, msg.msg_flags & MSG_TRUNC);
+	}
+#endif
+	return nreceived;
+}
+
+/* Return the sender of datagram i of those just received. */
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+const Peer *dgrampeer(const size_t i)
+{
+	return &received[i];
+}
+
+/* Return datagram i of those just received, setting its length. */
+#ifdef __GNUC__
+__attribute__((nonnull (2)))
+#endif
+const char *dgramdata(const size_t i, size_t * const length)
+{
+	*length = lengths[i];
+	return buffers + i * getdatagram()->size;
+}
+
+static bool writeall(const int fd, const char *buf, size_t n)
+{
+	while (n > 0) {
+		const ssize_t w = write(fd, buf, n);
+		if (w < 0 && errno != EINTR)
+			return true;
+		if (w > 0) {
+			buf += w;
+			n -= w;
+		}
+	}
+	return false;
+}
+
+/*
+ * Write the datagrams from first on to input.  In DGRAM_BATCH mode, each is
+ * preceded by a line giving its length and its peer.
+ */
+static bool writeinput(const int input, const size_t first, const size_t n)
+{
+	const DatagramOptions * const opts = getdatagram();
+	for (size_t i = first; i < first + n; i++) {
+		if (opts->mode == DGRAM_BATCH) {
+			SourceKey source;
+			char * const remote = describeremote(-1,
+				(struct sockaddr *) &received[i].address,
+				&source);
+			char header[32];
+			const int h = snprintf(header, sizeof header, "%zu ",
+				lengths[i]);
+			const bool e = writeall(input, header, h)
+				|| writeall(input, remote ? remote : "", remote
+				? strlen(remote) : 0)
+				|| writeall(input, "\n", 1);
+			free(remote);
+			if (e)
+				return true;
+		}
+		if (writeall(input, buffers + i * opts->size, lengths[i]))
+			return true;
+	}
+	if (lseek(input, 0, SEEK_SET) < 0)
+		return true;
+#if defined(__linux__) && defined(F_ADD_SEALS)
+	if (fcntl(input, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW
+		| F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+		return true;
+#endif
+	return false;
+}
+
+/*
+ * Set up a worker for n datagrams received from first on, setting the files
+ * of its standard input and output, the string form of the first peer and
+ * the source it is counted against, which is of the AF_UNSPEC family in
+ * DGRAM_BATCH mode.  The caller closes input and frees remote, but output
+ * belongs to the returned job.  Return SIZE_MAX on failure.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (3, 4, 5, 6)))
+#endif
+size_t dgramjob(const size_t first, const size_t n, int * const input,
+	int * const output, char ** const remote, SourceKey * const source)
+{
+	size_t job = 0;
+	while (job < njobs && jobs[job].output >= 0)
+		job++;
+	if (job == njobs) {
+		Job * const newptr = realloc(jobs, (njobs + 1) * sizeof *jobs);
+		if (!newptr)
+			return SIZE_MAX;
+		jobs = newptr;
+		jobs[njobs++] = (Job) {.output = -1};
+	}
+	Job * const j = &jobs[job];
+	*input = *output = -1;
+	*remote = NULL;
+	if (!(j->peers = malloc(n * sizeof *j->peers))
+		|| (*input = mkanonfile("request")) < 0
+		|| (*output = mkanonfile("reply")) < 0
+		|| writeinput(*input, first, n)
+		|| !(*remote = describeremote(-1,
+			(struct sockaddr *) &received[first].address, source)))
+		goto failure;
+	if (getdatagram()->mode == DGRAM_BATCH)
+		*source = (SourceKey) {0, AF_UNSPEC};
+	memcpy(j->peers, received + first, n * sizeof *j->peers);
+	j->npeers = n;
+	j->output = *output;
+	return job;
+
+failure:;
+	const int e = errno;
+	free(j->peers);
+	j->peers = NULL;
+	if (*input >= 0)
+		close(*input);
+	if (*output >= 0)
+		close(*output);
+	errno = e;
+	return SIZE_MAX;
+}
+
+void dgramdiscard(const size_t job)
+{
+	close(jobs[job].output);
+	jobs[job].output = -1;
+	free(jobs[job].peers);
+	jobs[job].peers = NULL;
+}
+
+/* Queue data to be sent to peer on listener by dgramflush(). */
+#ifdef __GNUC__
+__attribute__((nonnull (2, 3)))
+#endif
+void dgramreply(const int listener, const Peer * const peer,
+	const char * const data, const size_t length)
+{
+	if (nreplies == creplies) {
+		const size_t n = creplies == 0 ? 16 : 2 * creplies;
+		Reply * const newptr = realloc(replies, n * sizeof *replies);
+		if (!newptr) {
+			counters[COUNT_REPLIES_LOST]++;
+			return;
+		}
+		replies = newptr;
+		creplies = n;
+	}
+	Reply * const r = &replies[nreplies];
+	if (!(r->data = malloc(length))) {
+		counters[COUNT_REPLIES_LOST]++;
+		return;
+	}
+	memcpy(r->data, data, length);
+	r->length = length;
+	r->peer = *peer;
+	r->listener = listener;
+	nreplies++;
+}
+
+/*
+ * Queue the replies of a job whose worker exited, to be sent on listener, and
+ * free it.  Its output is one reply, or in DGRAM_BATCH mode, one line giving
+ * a length followed by that many bytes for each datagram in order, an empty
+ * reply being none.  Nothing is sent if listener is -1.
+ */
+void dgramfinish(const size_t job, const int listener)
+{
+	const DatagramOptions * const opts = getdatagram();
+	const bool framed = opts->mode == DGRAM_BATCH;
+	Job * const j = &jobs[job];
+	struct stat st;
+	char *buf = NULL;
+	size_t length = framed ? j->npeers * (opts->size + 24) : opts->size;
+	if (listener < 0 || fstat(j->output, &st) < 0 || st.st_size == 0)
+		goto done;
+	if ((uintmax_t) st.st_size < length)
+		length = st.st_size;
+	if (!(buf = malloc(length)))
+		goto done;
+	for (size_t n = 0; n < length; /* noop */) {
+		const ssize_t r = pread(j->output, buf + n, length - n, n);
+		if (r <= 0) {
+			length = n;
+			break;
+		}
+		n += r;
+	}
+	if (!framed) {
+		if (length > 0)
+			dgramreply(listener, &j->peers[0], buf, length);
+		goto done;
+	}
+	for (size_t i = 0, n = 0; i < j->npeers && n < length; i++) {
+		const char * const lf = memchr(buf + n, '\n', length - n);
+		char *end;
+		errno = 0;
+		const unsigned long size = lf ? strtoul(buf + n, &end, 10) : 0;
+		if (!lf || end != lf || errno || size > opts->size
+			|| size > length - (lf + 1 - buf))
+			break;
+		n = lf + 1 - buf;
+		if (size > 0)
+			dgramreply(listener, &j->peers[i], buf + n, size);
+		n += size;
+	}
+
+done:
+	free(buf);
+	dgramdiscard(job);
+}
+
+/* Send up to the configured batch of replies to listener. */
+#ifdef __GNUC__
+__attribute__((nonnull (2)))
+#endif
+static size_t sendbatch(const int listener, Reply * const batch,
+	const size_t n)
+{
+	size_t sent = 0;
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+	for (size_t i = 0; i < n; i++) {
+		iovs[i].iov_base = batch[i].data;
+		iovs[i].iov_len = batch[i].length;
+		msgs[i].msg_hdr = (struct msghdr) {
+			.msg_name = &batch[i].peer.address,
+			.msg_namelen = batch[i].peer.length,
+			.msg_iov = &iovs[i],
+			.msg_iovlen = 1
+		};
+	}
+	for (size_t done = 0; done < n; /* noop */) {
+		const int r = sendmmsg(listener, msgs + done, n - done,
+			MSG_DONTWAIT);
+		if (r > 0) {
+			sent += r;
+			done += r;
+		} else if (errno != EINTR) {
+			/* skip the datagram that could not be sent */
+			done++;
+		}
+	}
+#else
+	for (size_t i = 0; i < n; i++) {
+		sent += sendto(listener, batch[i].data, batch[i].length, 0,
+			(struct sockaddr *) &batch[i].peer.address,
+			batch[i].peer.length) >= 0;
+	}
+#endif
+	return sent;
+}
+
+/* Send the replies queued by dgramfinish(), dropping those that fail. */
+void dgramflush()
+{
+	if (nreplies == 0 || setup())
+		return;
+	const size_t batch = getdatagram()->batch;
+	for (size_t i = 0; i < nreplies; /* noop */) {
+		size_t n = 1;
+		while (i + n < nreplies && n < batch
+			&& replies[i + n].listener == replies[i].listener)
+			n++;
+		const size_t sent = sendbatch(replies[i].listener, replies + i,
+			n);
+		counters[COUNT_REPLIES] += sent;
+		counters[COUNT_REPLIES_LOST] += n - sent;
+		i += n;
+	}
+	for (size_t i = 0; i < nreplies; i++)
+		free(replies[i].data);
+	nreplies = 0;
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+void dgramsave(FILE * const state)
+{
+	stateputnum(state, njobs);
+	for (size_t i = 0; i < njobs; i++) {
+		stateputfd(state, jobs[i].output);
+		if (jobs[i].output < 0)
+			continue;
+		stateputnum(state, jobs[i].npeers);
+		for (size_t k = 0; k < jobs[i].npeers; k++)
+			stateputbytes(state, &jobs[i].peers[k].address,
+				jobs[i].peers[k].length);
+	}
+}
+
+/*
+ * Read the jobs of the workers of the previous process, which keep their
+ * indices.  Return true on failure.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+bool dgramload(FILE * const state)
+{
+	uintmax_t n, npeers;
+	if (setup() || stategetnum(state, &n) || n >= SIZE_MAX / sizeof *jobs
+		|| (n > 0 && !(jobs = malloc(n * sizeof *jobs))))
+		return true;
+	for (njobs = 0; njobs < n; njobs++) {
+		Job * const j = &jobs[njobs];
+		j->peers = NULL;
+		if (stategetfd(state, &j->output))
+			return true;
+		if (j->output < 0)
+			continue;
+		if (stategetnum(state, &npeers)
+			|| npeers >= SIZE_MAX / sizeof *j->peers
+			|| !(j->peers = malloc((npeers + 1) * sizeof *j->peers)))
+			return true;
+		for (j->npeers = 0; j->npeers < npeers; j->npeers++) {
+			Peer * const peer = &j->peers[j->npeers];
+			size_t length;
+			char * const address = stategetbytes(state, &length);
+			if (!address)
+				return true;
+			memset(&peer->address, 0, sizeof peer->address);
+			peer->length = length < sizeof peer->address ? length
+				: sizeof peer->address;
+			memcpy(&peer->address, address, peer->length);
+			free(address);
+		}
+	}
+	return false;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2023 Pierre Colin
+ * This file is part of the serve utility.
+ * 
+ * The serve utility is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * The serve utility is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+/* SourceKey is declared in remote.h */
+
+typedef struct {
+	struct sockaddr_storage address;
+	socklen_t length;
+} Peer;
+
+int dgramreceive(int listener, size_t max);
+
+const Peer *dgrampeer(size_t i)
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+;
+
+const char *dgramdata(size_t i, size_t *length)
+#ifdef __GNUC__
+__attribute__((nonnull (2)))
+#endif
+;
+
+size_t dgramjob(size_t first, size_t n, int *input, int *output,
+	char **remote, SourceKey *source)
+#ifdef __GNUC__
+__attribute__((nonnull (3, 4, 5, 6)))
+#endif
+;
+
+void dgramdiscard(size_t job);
+
+void dgramfinish(size_t job, int listener);
+
+void dgramreply(int listener, const Peer *peer, const char *data,
+	size_t length)
+#ifdef __GNUC__
+__attribute__((nonnull (2, 3)))
+#endif
+;
+
+void dgramflush(void);
+
+void dgramsave(FILE *state)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+bool dgramload(FILE *state)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
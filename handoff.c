@@ -0,0 +1,370 @@
+/*
+ * Copyright (C) 2023 Pierre Colin
+ * This file is part of the serve utility.
+ * 
+ * The serve utility is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * The serve utility is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "command.h"
+#include "handoff.h"
+#include "log.h"
+#include "metrics.h"
+#include "state.h"
+
+_Bool mknonblocking(int fildes);
+_Bool mkcloexec(int fildes);
+
+/* most backends registered at once */
+#define HANDOFF_BACKENDS 64
+
+/*
+ * Daemon connected to the control socket to be handed connections, of which
+ * outstanding were not reported done yet.
+ */
+typedef struct {
+	int fd;
+	short revents;
+	uintmax_t outstanding;
+} Backend;
+
+static int control = -1;
+/* whether the socket file of control is removed upon exit */
+static bool owned;
+static short controlevents;
+static Backend backends[HANDOFF_BACKENDS];
+static size_t nbackends;
+
+static void cleanup(void)
+{
+	if (control >= 0)
+		close(control);
+	/* not reached across an upgrade, which keeps the socket */
+	if (owned)
+		unlink(gethandoff());
+	for (size_t i = 0; i < nbackends; i++)
+		close(backends[i].fd);
+}
+
+/*
+ * Bind control to addr, removing the socket file left by a previous run
+ * first unless a server still listens on it.  Return true on failure.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+static bool bindcontrol(const struct sockaddr_un * const addr)
+{
+	const struct sockaddr * const a = (const struct sockaddr *) addr;
+	if (bind(control, a, sizeof *addr) == 0)
+		return false;
+	if (errno != EADDRINUSE)
+		return true;
+	/* files other than sockets are left alone */
+	struct stat st;
+	if (lstat(addr->sun_path, &st) < 0 || !S_ISSOCK(st.st_mode)) {
+		errno = EADDRINUSE;
+		return true;
+	}
+	const int probe = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (probe < 0)
+		return true;
+	/* a server too busy to accept at once is still live */
+	const bool live = !mknonblocking(probe)
+		|| connect(probe, a, sizeof *addr) == 0
+		|| errno != ECONNREFUSED;
+	close(probe);
+	if (live) {
+		errno = EADDRINUSE;
+		return true;
+	}
+	return unlink(addr->sun_path) < 0 || bind(control, a, sizeof *addr) < 0;
+}
+
+/*
+ * Open the control socket of the -H option unless it was handed over by the
+ * previous process.  Return true on failure.
+ */
+bool handoffinit()
+{
+	const char * const path = gethandoff();
+	static bool ready = false;
+	if (!path || ready)
+		return false;
+	ready = true;
+	atexit(cleanup);
+	if (control >= 0)
+		return false;
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	strcpy(addr.sun_path, path);
+	if ((control = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0)
+		return true;
+	if (bindcontrol(&addr))
+		goto failure;
+	owned = true;
+	if (listen(control, SOMAXCONN) < 0 || !mkcloexec(control)
+		|| !mknonblocking(control))
+		goto failure;
+	return false;
+
+failure:;
+	const int e = errno;
+	close(control);
+	control = -1;
+	errno = e;
+	return true;
+}
+
+/* most entries of fds handoffpoll() may fill */
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+size_t handoffsize()
+{
+	return gethandoff() ? 1 + HANDOFF_BACKENDS : 0;
+}
+
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+size_t handoffbackends()
+{
+	return nbackends;
+}
+
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+size_t handofflength()
+{
+	return control < 0 ? 0 : 1 + nbackends;
+}
+
+/* Fill handofflength() entries of fds to poll the control socket. */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+void handoffpoll(struct pollfd * const fds)
+{
+	if (control < 0)
+		return;
+	/* backends beyond the maximum wait for one to leave */
+	fds[0].fd = nbackends < HANDOFF_BACKENDS ? control : -1;
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
+	for (size_t i = 0; i < nbackends; i++) {
+		fds[i + 1].fd = backends[i].fd;
+		fds[i + 1].events = POLLIN;
+		fds[i + 1].revents = 0;
+	}
+}
+
+/* Save the events of entries filled by handoffpoll(), returning their count. */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+int handoffrevents(const struct pollfd * const fds)
+{
+	if (control < 0)
+		return 0;
+	int n = (controlevents = fds[0].revents) != 0;
+	for (size_t i = 0; i < nbackends; i++)
+		n += (backends[i].revents = fds[i + 1].revents) != 0;
+	return n;
+}
+
+static void removebackend(const size_t i)
+{
+	close(backends[i].fd);
+	logprintf("Backend left with %ju connections outstanding\n",
+		backends[i].outstanding);
+	backends[i] = backends[--nbackends];
+	gauges[GAUGE_BACKENDS] = nbackends;
+}
+
+/*
+ * Register the backends connecting to the control socket, and count the
+ * connections backends report done, one per packet they send.
+ */
+void handoffserve()
+{
+	for (size_t i = 0; i < nbackends; /* noop */) {
+		Backend * const b = &backends[i];
+		if (!b->revents) {
+			i++;
+			continue;
+		}
+		b->revents = 0;
+		char buf[64];
+		ssize_t n;
+		while ((n = recv(b->fd, buf, sizeof buf, MSG_DONTWAIT)) > 0) {
+			if (b->outstanding > 0)
+				b->outstanding--;
+		}
+		if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+			&& errno != EINTR))
+			removebackend(i);
+		else
+			i++;
+	}
+	while (controlevents && nbackends < HANDOFF_BACKENDS) {
+		const int fd = accept(control, NULL, NULL);
+		if (fd < 0)
+			break;
+		if (!mkcloexec(fd) || !mknonblocking(fd)) {
+			close(fd);
+			continue;
+		}
+		backends[nbackends++] = (Backend) {fd, 0, 0};
+		gauges[GAUGE_BACKENDS] = nbackends;
+		logprintf("Backend registered\n");
+	}
+	controlevents = 0;
+}
+
+/*
+ * Hand sock, a connection to service, over to the backend with the fewest
+ * outstanding connections, along with the index of service and remote so
+ * that backends serving several services can tell them apart.  Return true
+ * if no backend took it.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (3)))
+#endif
+bool handoffsend(const int sock, const size_t service,
+	const char * const remote)
+{
+	static char lf[] = "\n";
+	char index[24];
+	const int len = snprintf(index, sizeof index, "%zu ", service);
+	struct iovec iov[3] = {
+		{index, len}, {(char *) remote, strlen(remote)}, {lf, 1}
+	};
+	union {
+		struct cmsghdr header;
+		char buf[CMSG_SPACE(sizeof (int))];
+	} ancillary;
+	struct msghdr msg = {
+		.msg_iov = iov, .msg_iovlen = 3,
+		.msg_control = ancillary.buf,
+		.msg_controllen = sizeof ancillary.buf
+	};
+	struct cmsghdr * const cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof (int));
+	memcpy(CMSG_DATA(cmsg), &sock, sizeof sock);
+	/* backends too busy to read are skipped, closed ones removed */
+	bool busy[HANDOFF_BACKENDS] = {false};
+	for (;;) {
+		size_t best = SIZE_MAX;
+		for (size_t i = 0; i < nbackends; i++) {
+			if (!busy[i] && (best == SIZE_MAX
+				|| backends[i].outstanding
+				< backends[best].outstanding))
+				best = i;
+		}
+		if (best == SIZE_MAX)
+			return true;
+		if (sendmsg(backends[best].fd, &msg, MSG_DONTWAIT
+			| MSG_NOSIGNAL) >= 0) {
+			backends[best].outstanding++;
+			counters[COUNT_HANDED_OFF]++;
+			return false;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR
+			|| errno == ENOBUFS) {
+			busy[best] = true;
+		} else {
+			/* the last backend takes the place of this one */
+			busy[best] = busy[nbackends - 1];
+			removebackend(best);
+		}
+	}
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+void handoffsave(FILE * const state)
+{
+	stateputfd(state, control);
+	stateputnum(state, nbackends);
+	for (size_t i = 0; i < nbackends; i++) {
+		stateputfd(state, backends[i].fd);
+		stateputnum(state, backends[i].outstanding);
+	}
+}
+
+/*
+ * Close the control socket handed over by the previous process unless it is
+ * bound to the path of the -H option, removing its socket file in that case
+ * since that process left it to this one.
+ */
+static void dropcontrol()
+{
+	const char * const path = gethandoff();
+	struct sockaddr_un addr = {0};
+	socklen_t len = sizeof addr - 1;
+	if (getsockname(control, (struct sockaddr *) &addr, &len) == 0
+		&& path && strcmp(addr.sun_path, path) == 0)
+		return;
+	close(control);
+	control = -1;
+	if (addr.sun_path[0])
+		unlink(addr.sun_path);
+}
+
+/*
+ * Take over the control socket and backends of the previous process, closing
+ * them if the -H option is no longer given, and the control socket if its
+ * path changed so that handoffinit() binds a new one.  Return true on failure.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+bool handoffload(FILE * const state)
+{
+	uintmax_t n, outstanding;
+	int fd;
+	if (stategetfd(state, &control) || stategetnum(state, &n))
+		return true;
+	for (uintmax_t i = 0; i < n; i++) {
+		if (stategetfd(state, &fd) || stategetnum(state, &outstanding))
+			return true;
+		if (fd < 0)
+			continue;
+		if (nbackends < HANDOFF_BACKENDS && gethandoff())
+			backends[nbackends++] = (Backend) {fd, 0, outstanding};
+		else
+			close(fd);
+	}
+	if (control >= 0)
+		dropcontrol();
+	owned = control >= 0;
+	gauges[GAUGE_BACKENDS] = nbackends;
+	return false;
+}
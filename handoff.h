@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2023 Pierre Colin
+ * This file is part of the serve utility.
+ * 
+ * The serve utility is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * The serve utility is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+bool handoffinit(void);
+
+size_t handoffsize(void)
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+;
+
+size_t handoffbackends(void)
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+;
+
+size_t handofflength(void)
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+;
+
+void handoffpoll(struct pollfd *fds)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+int handoffrevents(const struct pollfd *fds)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+void handoffserve(void);
+
+bool handoffsend(int sock, size_t service, const char *remote)
+#ifdef __GNUC__
+__attribute__((nonnull (3)))
+#endif
+;
+
+void handoffsave(FILE *state)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+bool handoffload(FILE *state)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
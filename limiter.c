@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2023 Pierre Colin
+ * This file is part of the serve utility.
+ * 
+ * The serve utility is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * The serve utility is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "command.h"
+#include "limiter.h"
+
+/*
+ * Gradient concurrency limiter.  The short-term average session duration is
+ * compared to the long-term one: while they agree within the tolerance, the
+ * limit grows by about the square root of itself, and once sessions take
+ * longer, it shrinks in proportion, down to half of itself.
+ */
+#define SHORT_WEIGHT 0.2
+#define LONG_WEIGHT 0.01
+#define SMOOTHING 0.2
+
+static double limit, shortterm, longterm;
+
+uint_fast32_t sessionlimit()
+{
+	const AdaptiveLimit * const opts = getadaptive();
+	if (!opts->enabled)
+		return getmaxsessions();
+	if (limit == 0)
+		limit = opts->initial;
+	return limit;
+}
+
+/*
+ * Account for a session that lasted duration microseconds, while sessions
+ * sessions were running, including it.
+ */
+void limitersample(uint_fast64_t duration, const size_t sessions)
+{
+	const AdaptiveLimit * const opts = getadaptive();
+	if (!opts->enabled)
+		return;
+	if (duration == 0)
+		duration = 1;
+	if (shortterm == 0) {
+		shortterm = longterm = duration;
+		return;
+	}
+	shortterm += SHORT_WEIGHT * (duration - shortterm);
+	longterm += LONG_WEIGHT * (duration - longterm);
+	/* let the baseline follow lasting improvements quickly */
+	if (longterm > 2 * shortterm)
+		longterm *= 0.95;
+	if (limit == 0)
+		limit = opts->initial;
+	const double current = limit;
+	/* too few sessions to tell whether more would slow them down */
+	if (2 * sessions < current)
+		return;
+	double gradient = opts->tolerance / 100.0 * longterm / shortterm;
+	if (gradient > 1)
+		gradient = 1;
+	else if (gradient < 0.5)
+		gradient = 0.5;
+	/* headroom only while sessions keep their usual duration */
+	const double target = gradient < 1 ? current * gradient
+		: current + sqrt(current);
+	limit = current + SMOOTHING * (target - current);
+	if (limit < opts->min)
+		limit = opts->min;
+	else if (limit > opts->max)
+		limit = opts->max;
+}
@@ -0,0 +1,389 @@
+/*
+ * Copyright (C) 2023 Pierre Colin
+ * This file is part of the serve utility.
+ * 
+ * The serve utility is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * The serve utility is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "command.h"
+#include "log.h"
+
+/*
+ * The event loop formats lines into the front buffer while the writer thread
+ * writes the back buffer out; they swap whenever the writer is done.  The
+ * event loop therefore never waits on the file system, and if the writer
+ * falls behind, lines that do not fit are counted and dropped.
+ */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pthread_t writer;
+static char *front, *back;
+static size_t nfront, capacity;
+static uintmax_t lost, lostbytes;
+static bool reopen, stop, writing;
+
+/* owned by the event loop; see logtick() */
+static char stamp[80];
+static size_t nstamp;
+static struct timespec stampwall, stampmono;
+
+/* owned by the writer thread once started */
+static int fildes = -1;
+static bool splicable;
+static uintmax_t size;
+static time_t opened;
+
+static int openlog(const char * const restrict path)
+{
+	const int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+		0666);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	size = fstat(fd, &st) < 0 ? 0 : st.st_size;
+	opened = time(NULL);
+	return fd;
+}
+
+/* path followed by a dot and generation g, or NULL on failure */
+static char *generation(const char * const restrict path,
+	const uint_fast32_t g)
+{
+	const size_t n = strlen(path) + 12;
+	char * const s = malloc(n);
+	if (s)
+		snprintf(s, n, "%s.%lu", path, (unsigned long) g);
+	return s;
+}
+
+static void replacelog(const bool rotate)
+{
+	const LogOptions * const opts = getlogoptions();
+	if (rotate && opts->keep == 0) {
+		unlink(opts->file);
+	} else if (rotate) {
+		char *to = generation(opts->file, opts->keep);
+		for (uint_fast32_t g = opts->keep; to && g > 1; g--) {
+			char * const from = generation(opts->file, g - 1);
+			if (from)
+				rename(from, to);
+			free(to);
+			to = from;
+		}
+		if (to && rename(opts->file, to) < 0)
+			perror("Could not rotate the log file");
+		free(to);
+	}
+	const int fd = openlog(opts->file);
+	if (fd < 0) {
+		perror("Could not reopen the log file");
+		/* retry at the next rotation instead of right away */
+		opened = time(NULL);
+		return;
+	}
+	close(fildes);
+	fildes = fd;
+}
+
+static bool needrotate(void)
+{
+	const LogOptions * const opts = getlogoptions();
+	if (!opts->file)
+		return false;
+	return (opts->size > 0 && size >= opts->size)
+		|| (opts->age > 0 && difftime(time(NULL), opened) >= opts->age);
+}
+
+/* Write buf out, returning how many bytes of it could not be written. */
+static size_t writeall(const char *buf, size_t n)
+{
+	while (n > 0) {
+		const ssize_t w = write(fildes, buf, n);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Could not write to the log");
+			return n;
+		}
+		buf += w;
+		n -= w;
+		size += w;
+	}
+	return 0;
+}
+
+static void *writelog(void * const arg)
+{
+	(void) arg;
+	const LogOptions * const opts = getlogoptions();
+	pthread_mutex_lock(&mutex);
+	for (;;) {
+		while (nfront == 0 && !reopen && !stop) {
+			if (!opts->file || opts->age == 0) {
+				pthread_cond_wait(&cond, &mutex);
+				continue;
+			}
+			struct timespec deadline = {opened + opts->age, 0};
+			if (pthread_cond_timedwait(&cond, &mutex, &deadline)
+				== ETIMEDOUT)
+				break;
+		}
+		if (nfront == 0 && stop)
+			break;
+		char * const buf = front;
+		const size_t n = nfront;
+		const uintmax_t l = lost;
+		uintmax_t lb = lostbytes;
+		const bool r = reopen;
+		front = back;
+		back = buf;
+		nfront = 0;
+		lost = 0;
+		lostbytes = 0;
+		reopen = false;
+		writing = true;
+		pthread_mutex_unlock(&mutex);
+		if (opts->file && r)
+			replacelog(false);
+		lb += writeall(buf, n);
+		if (l > 0) {
+			char msg[64];
+			const int m = snprintf(msg, sizeof msg,
+				"%ju log lines lost\n", l);
+			writeall(msg, m);
+		}
+		if (lb > 0) {
+			char msg[64];
+			const int m = snprintf(msg, sizeof msg,
+				"%ju log bytes lost\n", lb);
+			writeall(msg, m);
+		}
+		if (needrotate())
+			replacelog(true);
+		pthread_mutex_lock(&mutex);
+		writing = false;
+		/* wake up logflush() */
+		pthread_cond_broadcast(&cond);
+	}
+	pthread_mutex_unlock(&mutex);
+	return NULL;
+}
+
+static void cleanup(void)
+{
+	pthread_mutex_lock(&mutex);
+	stop = true;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&mutex);
+	pthread_join(writer, NULL);
+	if (fildes != STDOUT_FILENO)
+		close(fildes);
+	free(front);
+	free(back);
+}
+
+bool loginit()
+{
+	const LogOptions * const opts = getlogoptions();
+	capacity = opts->buffer;
+	if (!(front = malloc(capacity)) || !(back = malloc(capacity)))
+		return true;
+	if (!opts->file) {
+		struct stat st;
+		fildes = STDOUT_FILENO;
+		splicable = fstat(fildes, &st) == 0 && S_ISFIFO(st.st_mode);
+	} else if ((fildes = openlog(opts->file)) < 0) {
+		return true;
+	}
+	/* signals must interrupt the event loop, not the writer */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	const int e = pthread_create(&writer, NULL, writelog, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (e != 0) {
+		errno = e;
+		return true;
+	}
+	atexit(cleanup);
+	return false;
+}
+
+/* Truncate t to the configured precision and tell whether it changed. */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+static bool quantize(struct timespec * const restrict cached,
+	struct timespec t, const long scale)
+{
+	t.tv_nsec -= t.tv_nsec % scale;
+	if (t.tv_sec == cached->tv_sec && t.tv_nsec == cached->tv_nsec)
+		return false;
+	*cached = t;
+	return true;
+}
+
+/*
+ * Format the time prefix of log lines.  The event loop calls this once per
+ * iteration with the time it already read, and the prefix is only formatted
+ * again when it changes at the configured precision.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+void logtick(const struct timespec * const monotonic)
+{
+	static const long scales[] = {
+		1000000000, 100000000, 10000000, 1000000, 100000, 10000, 1000,
+		100, 10, 1
+	};
+	const LogOptions * const opts = getlogoptions();
+	if (opts->clocks == 0)
+		return;
+	const int digits = opts->precision;
+	const long scale = scales[digits];
+	bool changed = false;
+	if (opts->clocks & LOG_WALL) {
+		struct timespec wall;
+		clock_gettime(CLOCK_REALTIME, &wall);
+		changed |= quantize(&stampwall, wall, scale);
+	}
+	if (opts->clocks & LOG_MONOTONIC)
+		changed |= quantize(&stampmono, *monotonic, scale);
+	if (!changed)
+		return;
+	nstamp = 0;
+	if (opts->clocks & LOG_WALL) {
+		struct tm tm;
+		gmtime_r(&stampwall.tv_sec, &tm);
+		nstamp += strftime(stamp, sizeof stamp, "%Y-%m-%dT%H:%M:%S",
+			&tm);
+		if (digits > 0)
+			nstamp += sprintf(stamp + nstamp, ".%0*ld", digits,
+				stampwall.tv_nsec / scale);
+		nstamp += sprintf(stamp + nstamp, "Z ");
+	}
+	if (opts->clocks & LOG_MONOTONIC) {
+		nstamp += sprintf(stamp + nstamp, "%jd",
+			(intmax_t) stampmono.tv_sec);
+		if (digits > 0)
+			nstamp += sprintf(stamp + nstamp, ".%0*ld", digits,
+				stampmono.tv_nsec / scale);
+		nstamp += sprintf(stamp + nstamp, " ");
+	}
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1), format (printf, 1, 2)))
+#endif
+void logprintf(const char * const format, ...)
+{
+	pthread_mutex_lock(&mutex);
+	const size_t room = capacity - nfront;
+	va_list ap;
+	va_start(ap, format);
+	const int n = room <= nstamp ? -1 : vsnprintf(front + nfront + nstamp,
+		room - nstamp, format, ap);
+	va_end(ap);
+	if (n < 0 || (size_t) n >= room - nstamp) {
+		lost++;
+	} else {
+		if (nfront == 0)
+			pthread_cond_signal(&cond);
+		memcpy(front + nfront, stamp, nstamp);
+		nfront += nstamp + n;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+/* Queue n raw bytes, returning true if they do not fit and are dropped. */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+bool logwrite(const void * const buf, const size_t n)
+{
+	pthread_mutex_lock(&mutex);
+	const bool fits = n <= capacity - nfront;
+	if (!fits) {
+		lostbytes += n;
+	} else {
+		if (nfront == 0)
+			pthread_cond_signal(&cond);
+		memcpy(front + nfront, buf, n);
+		nfront += n;
+	}
+	pthread_mutex_unlock(&mutex);
+	return !fits;
+}
+
+/*
+ * Move up to n bytes from the pipe from straight to the log without copying
+ * them through user space.  This only works on Linux, when the log is a pipe
+ * and when nothing is queued before, lest the order be lost.  Otherwise, or
+ * if the log pipe is full, fail with EAGAIN and let the caller copy.
+ */
+ssize_t logsplice(const int from, const size_t n)
+{
+#ifdef __linux__
+	if (splicable) {
+		pthread_mutex_lock(&mutex);
+		const bool idle = nfront == 0 && !writing;
+		pthread_mutex_unlock(&mutex);
+		/* only the event loop queues data, so idle stays true */
+		if (idle)
+			return splice(from, NULL, fildes, NULL, n,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	}
+#else
+	(void) from;
+	(void) n;
+#endif
+	errno = EAGAIN;
+	return -1;
+}
+
+void logreopen()
+{
+	pthread_mutex_lock(&mutex);
+	reopen = true;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&mutex);
+}
+
+/* Wait until every line queued so far is written out. */
+void logflush()
+{
+	pthread_mutex_lock(&mutex);
+	while (nfront > 0 || writing) {
+		pthread_cond_signal(&cond);
+		pthread_cond_wait(&cond, &mutex);
+	}
+	pthread_mutex_unlock(&mutex);
+}
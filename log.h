@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2023 Pierre Colin
+ * This file is part of the serve utility.
+ * 
+ * The serve utility is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * The serve utility is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+#include <sys/types.h>
+#include <time.h>
+
+bool loginit(void);
+
+void logprintf(const char *format, ...)
+#ifdef __GNUC__
+__attribute__((nonnull (1), format (printf, 1, 2)))
+#endif
+;
+
+bool logwrite(const void *buf, size_t n)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+ssize_t logsplice(int from, size_t n);
+
+void logreopen(void);
+
+void logflush(void);
+
+void logtick(const struct timespec *monotonic)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2023 Pierre Colin
+ * This file is part of the serve utility.
+ * 
+ * The serve utility is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * The serve utility is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdio.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "state.h"
+
+uintmax_t counters[NCOUNTERS], gauges[NGAUGES];
+
+/* Print all metrics on one log line of name=value pairs. */
+void logmetrics()
+{
+	/* names MUST be in the same order as the enumerations */
+	static const char * const cnames[NCOUNTERS] = {
+		"accepted", "created", "exited", "source_refused",
+		"shed_sessions", "shed_load", "shed_backlog", "queued",
+		"expired", "throttled", "exec_failed", "shed_breaker",
+		"deferred", "idle", "preread", "datagrams", "replies",
+		"replies_lost", "peer_expired", "peer_dropped", "handed_off",
+		"truncated"
+	};
+	static const char * const gnames[NGAUGES] = {
+		"sessions", "limit", "queue", "wait_p50_ms", "wait_p90_ms",
+		"wait_p99_ms", "spawn_tokens", "breaker", "waiting_data",
+		"peers", "backends"
+	};
+	char line[1024];
+	size_t n = 0;
+	for (int i = 0; i < NCOUNTERS && n < sizeof line; i++)
+		n += snprintf(line + n, sizeof line - n, " %s=%ju", cnames[i],
+			counters[i]);
+	for (int i = 0; i < NGAUGES && n < sizeof line; i++)
+		n += snprintf(line + n, sizeof line - n, " %s=%ju", gnames[i],
+			gauges[i]);
+	logprintf("Metrics:%s\n", line);
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+void metricssave(FILE * const state)
+{
+	stateputnum(state, NCOUNTERS);
+	for (int i = 0; i < NCOUNTERS; i++)
+		stateputnum(state, counters[i]);
+}
+
+/*
+ * Read the counters of the previous process.  Those it did not know of stay
+ * at zero and those this one does not know of are skipped.  Gauges are not
+ * read since they are set anew.  Return true on failure.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+bool metricsload(FILE * const state)
+{
+	uintmax_t n, value;
+	if (stategetnum(state, &n))
+		return true;
+	for (uintmax_t i = 0; i < n; i++) {
+		if (stategetnum(state, &value))
+			return true;
+		if (i < NCOUNTERS)
+			counters[i] = value;
+	}
+	return false;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2023 Pierre Colin
+ * This file is part of the serve utility.
+ * 
+ * The serve utility is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * The serve utility is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* counters only ever grow; gauges are set to their current value */
+enum {
+	COUNT_ACCEPTED, COUNT_CREATED, COUNT_EXITED, COUNT_SOURCE,
+	COUNT_SHED_SESSIONS, COUNT_SHED_LOAD, COUNT_SHED_BACKLOG,
+	COUNT_QUEUED, COUNT_EXPIRED, COUNT_THROTTLED, COUNT_EXEC_FAILED,
+	COUNT_SHED_BREAKER, COUNT_DEFERRED, COUNT_IDLE,
+	COUNT_PREREAD, COUNT_DATAGRAMS, COUNT_REPLIES, COUNT_REPLIES_LOST,
+	COUNT_PEER_EXPIRED, COUNT_PEER_DROPPED, COUNT_HANDED_OFF,
+	COUNT_TRUNCATED, NCOUNTERS
+};
+
+enum {
+	GAUGE_SESSIONS, GAUGE_LIMIT, GAUGE_QUEUE, GAUGE_WAIT_P50,
+	GAUGE_WAIT_P90, GAUGE_WAIT_P99, GAUGE_SPAWN_TOKENS, GAUGE_BREAKER,
+	GAUGE_DEFERRED, GAUGE_PEERS, GAUGE_BACKENDS, NGAUGES
+};
+
+extern uintmax_t counters[NCOUNTERS], gauges[NGAUGES];
+
+void logmetrics(void);
+
+void metricssave(FILE *state)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+bool metricsload(FILE *state)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2023 Pierre Colin
+ * This file is part of the serve utility.
+ * 
+ * The serve utility is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * The serve utility is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifdef __linux__
+/* for getloadavg() and struct tcp_info */
+#define _GNU_SOURCE
+#endif
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "command.h"
+#include "metrics.h"
+#include "overload.h"
+
+_Bool mknonblocking(int fildes);
+
+/* milliseconds during which a load average reading is reused */
+#define LOAD_PERIOD 1000
+
+static double loadaverage(const uint_fast64_t now)
+{
+	static double load;
+	static uint_fast64_t last;
+	static bool known;
+	if (known && now - last < LOAD_PERIOD)
+		return load;
+#ifdef __linux__
+	if (getloadavg(&load, 1) < 1)
+		load = 0;
+#endif
+	last = now;
+	known = true;
+	return load;
+}
+
+/* connections waiting in the listen queue, or 0 if unknown */
+static uint_fast32_t backlog(const int listener)
+{
+#if defined(__linux__) && defined(TCP_INFO)
+	struct tcp_info info;
+	socklen_t len = sizeof info;
+	/* for a listening socket, tcpi_unacked is the accept queue length */
+	if (getsockopt(listener, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+		return info.tcpi_unacked;
+#else
+	(void) listener;
+#endif
+	return 0;
+}
+
+/*
+ * Tell whether a connection just accepted should be shed rather than given a
+ * worker process, returning the counter of the reason why or -1.  full tells
+ * whether there is neither a free session nor room in the queue, which holds
+ * queued connections.
+ */
+int overloaded(const int listener, const bool full, const size_t queued,
+	const uint_fast64_t now)
+{
+	const OverloadPolicy * const policy = getoverload();
+	if (policy->full && full)
+		return COUNT_SHED_SESSIONS;
+	if (policy->load > 0 && loadaverage(now) >= policy->load)
+		return COUNT_SHED_LOAD;
+	if (policy->backlog > 0
+		&& backlog(listener) + queued >= policy->backlog)
+		return COUNT_SHED_BACKLOG;
+	return -1;
+}
+
+/* Send the overload reply, if any, without waiting for the peer. */
+void shed(const int sock)
+{
+	const OverloadPolicy * const policy = getoverload();
+	if (policy->length > 0) {
+#ifdef MSG_DONTWAIT
+		const int flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+#else
+		const int flags = MSG_NOSIGNAL;
+		mknonblocking(sock);
+#endif
+		(void) send(sock, policy->reply, policy->length, flags);
+	}
+}
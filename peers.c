@@ -0,0 +1,469 @@
+/*
+ * Copyright (C) 2023 Pierre Colin
+ * This file is part of the serve utility.
+ * 
+ * The serve utility is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * The serve utility is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "command.h"
+#include "remote.h"
+#include "dgram.h"
+#include "metrics.h"
+#include "peers.h"
+#include "state.h"
+
+/* slots of the timer wheel, covering the idle timeout */
+#define NSLOTS 64
+#define NONE SIZE_MAX
+
+/*
+ * Session of a datagram peer, whose worker process reads the datagrams of the
+ * peer from fd and writes its replies to it.  Open sessions are found through
+ * a hash table whose chains are linked by next, and expire through a timer
+ * wheel whose slots are lists linked by older and newer.  Once expired, or
+ * closed by its worker, a session has an fd of -1 and only waits for its
+ * worker to exit.  Free sessions are linked by next too.
+ */
+typedef struct {
+	Peer peer;
+	size_t service;
+	int fd;
+	short revents;
+	bool used;
+	uint_fast64_t last;
+	size_t next, older, newer, slot;
+} Session;
+
+static Session *sessions;
+static size_t csessions, nopen, freelist = NONE;
+static size_t *buckets;
+static size_t nbuckets;
+/* the wheel turns by a slot every tick milliseconds, up to current */
+static size_t wheel[NSLOTS];
+static uint_fast64_t tick, current;
+static size_t narmed;
+static char *buffer;
+
+static void cleanup(void)
+{
+	for (size_t i = 0; i < csessions; i++) {
+		if (sessions[i].used && sessions[i].fd >= 0)
+			close(sessions[i].fd);
+	}
+	free(sessions);
+	free(buckets);
+	free(buffer);
+}
+
+static bool setup(const uint_fast64_t now)
+{
+	if (tick > 0)
+		return false;
+	if (!(buffer = malloc(getdatagram()->size)))
+		return true;
+	for (size_t i = 0; i < NSLOTS; i++)
+		wheel[i] = NONE;
+	tick = getdatagram()->idle / (NSLOTS - 1) + 1;
+	current = now / tick;
+	atexit(cleanup);
+	return false;
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (2), pure))
+#endif
+static size_t hash(const size_t service, const Peer * const peer)
+{
+	/* FNV-1a */
+	uint_least64_t h = 14695981039346656037u;
+	const unsigned char * const bytes = (const void *) &peer->address;
+	for (size_t i = 0; i < sizeof service; i++)
+		h = (h ^ (service >> 8 * i & 0xff)) * 1099511628211u;
+	for (socklen_t i = 0; i < peer->length; i++)
+		h = (h ^ bytes[i]) * 1099511628211u;
+	return h & (nbuckets - 1);
+}
+
+/* Chain the open sessions anew into the buckets. */
+static void chain(void)
+{
+	for (size_t i = 0; i < nbuckets; i++)
+		buckets[i] = NONE;
+	for (size_t i = 0; i < csessions; i++) {
+		Session * const s = &sessions[i];
+		if (!s->used || s->fd < 0)
+			continue;
+		const size_t h = hash(s->service, &s->peer);
+		s->next = buckets[h];
+		buckets[h] = i;
+	}
+}
+
+/* Chain the open sessions anew into n buckets.  Return true on failure. */
+static bool rehash(const size_t n)
+{
+	size_t * const newptr = realloc(buckets, n * sizeof *buckets);
+	if (!newptr)
+		return true;
+	buckets = newptr;
+	nbuckets = n;
+	chain();
+	return false;
+}
+
+/* Put session i in the slot of the tick when it goes idle. */
+static void arm(const size_t i)
+{
+	Session * const s = &sessions[i];
+	uint_fast64_t t = (s->last + getdatagram()->idle) / tick;
+	if (t <= current)
+		t = current + 1;
+	s->slot = t % NSLOTS;
+	s->older = NONE;
+	s->newer = wheel[s->slot];
+	if (s->newer != NONE)
+		sessions[s->newer].older = i;
+	wheel[s->slot] = i;
+	narmed++;
+}
+
+static void disarm(const size_t i)
+{
+	Session * const s = &sessions[i];
+	if (s->slot == NONE)
+		return;
+	if (s->older != NONE)
+		sessions[s->older].newer = s->newer;
+	else
+		wheel[s->slot] = s->newer;
+	if (s->newer != NONE)
+		sessions[s->newer].older = s->older;
+	s->slot = NONE;
+	narmed--;
+}
+
+/* Close session i, leaving it for its worker process to exit. */
+static void detach(const size_t i)
+{
+	Session * const s = &sessions[i];
+	if (s->fd < 0)
+		return;
+	size_t * next = &buckets[hash(s->service, &s->peer)];
+	while (*next != i)
+		next = &sessions[*next].next;
+	*next = s->next;
+	disarm(i);
+	close(s->fd);
+	s->fd = -1;
+	gauges[GAUGE_PEERS] = --nopen;
+}
+
+/* Return the open session of peer on service, or SIZE_MAX. */
+#ifdef __GNUC__
+__attribute__((nonnull (2), pure))
+#endif
+size_t peerfind(const size_t service, const Peer * const peer)
+{
+	if (nopen == 0)
+		return NONE;
+	size_t i = buckets[hash(service, peer)];
+	while (i != NONE && (sessions[i].service != service
+		|| sessions[i].peer.length != peer->length
+		|| memcmp(&sessions[i].peer.address, &peer->address,
+		peer->length) != 0))
+		i = sessions[i].next;
+	return i;
+}
+
+/* Add a session of peer on service whose worker uses fd, or SIZE_MAX. */
+#ifdef __GNUC__
+__attribute__((nonnull (2)))
+#endif
+size_t peeradd(const size_t service, const Peer * const peer, const int fd,
+	const uint_fast64_t now)
+{
+	if (setup(now) || (nopen + 1 > nbuckets
+		&& rehash(nbuckets == 0 ? 64 : 2 * nbuckets)))
+		return NONE;
+	if (freelist == NONE) {
+		const size_t n = csessions == 0 ? 16 : 2 * csessions;
+		Session * const newptr = realloc(sessions, n * sizeof *sessions);
+		if (!newptr)
+			return NONE;
+		sessions = newptr;
+		for (size_t i = n; i-- > csessions; /* noop */) {
+			sessions[i].used = false;
+			sessions[i].next = freelist;
+			freelist = i;
+		}
+		csessions = n;
+	}
+	const size_t i = freelist;
+	Session * const s = &sessions[i];
+	freelist = s->next;
+	*s = (Session) {
+		.peer = *peer, .service = service, .fd = fd, .used = true,
+		.last = now
+	};
+	const size_t h = hash(service, peer);
+	s->next = buckets[h];
+	buckets[h] = i;
+	arm(i);
+	gauges[GAUGE_PEERS] = ++nopen;
+	return i;
+}
+
+/*
+ * Give a datagram to the worker of session without waiting.  Return true if
+ * it could not take it.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (2)))
+#endif
+bool peersend(const size_t session, const char * const data,
+	const size_t length, const uint_fast64_t now)
+{
+	Session * const s = &sessions[session];
+	s->last = now;
+	return send(s->fd, data, length, MSG_DONTWAIT | MSG_NOSIGNAL) < 0;
+}
+
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+size_t peerlength()
+{
+	return nopen;
+}
+
+/* Fill peerlength() entries of fds to poll the open sessions. */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+void peerpoll(struct pollfd * const fds)
+{
+	size_t k = 0;
+	for (size_t i = 0; i < csessions; i++) {
+		if (!sessions[i].used || sessions[i].fd < 0)
+			continue;
+		fds[k].fd = sessions[i].fd;
+		fds[k].events = POLLIN;
+		fds[k++].revents = 0;
+	}
+}
+
+/* Save the events of entries filled by peerpoll(), returning their count. */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+int peerrevents(const struct pollfd * const fds)
+{
+	size_t k = 0;
+	int n = 0;
+	for (size_t i = 0; i < csessions; i++) {
+		if (!sessions[i].used || sessions[i].fd < 0)
+			continue;
+		n += (sessions[i].revents = fds[k++].revents) != 0;
+	}
+	return n;
+}
+
+/*
+ * Queue up to max replies written by the worker of session i to be sent to its
+ * peer, closing the session if the worker closed its end.
+ */
+static void drain(const size_t i, const uint_fast32_t max)
+{
+	Session * const s = &sessions[i];
+	const int listener = getservice(s->service)->listener;
+	ssize_t n = 0;
+	for (uint_fast32_t k = 0; k < max; k++) {
+		if ((n = recv(s->fd, buffer, getdatagram()->size,
+			MSG_DONTWAIT)) <= 0)
+			break;
+		dgramreply(listener, &s->peer, buffer, n);
+	}
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+		&& errno != EINTR))
+		detach(i);
+}
+
+/* Queue the replies written by workers to be sent to their peers. */
+void peerforward()
+{
+	for (size_t i = 0; i < csessions; i++) {
+		Session * const s = &sessions[i];
+		if (!s->used || s->fd < 0 || !s->revents)
+			continue;
+		s->revents = 0;
+		drain(i, getdatagram()->batch);
+	}
+}
+
+/* Free session once its worker exited, sending the replies it left. */
+void peerend(const size_t session)
+{
+	if (sessions[session].fd >= 0)
+		drain(session, UINT_FAST32_MAX);
+	detach(session);
+	sessions[session].used = false;
+	sessions[session].next = freelist;
+	freelist = session;
+}
+
+/* Close the sessions that went idle, turning the wheel up to now. */
+void peertick(const uint_fast64_t now)
+{
+	if (tick == 0)
+		return;
+	const uint_fast64_t idle = getdatagram()->idle;
+	const uint_fast64_t target = now / tick;
+	if (target - current > NSLOTS)
+		current = target - NSLOTS;
+	while (current < target && narmed > 0) {
+		size_t i = wheel[++current % NSLOTS];
+		wheel[current % NSLOTS] = NONE;
+		while (i != NONE) {
+			Session * const s = &sessions[i];
+			const size_t next = s->newer;
+			s->slot = NONE;
+			narmed--;
+			if ((s->last + idle) / tick <= current) {
+				detach(i);
+				counters[COUNT_PEER_EXPIRED]++;
+			} else {
+				arm(i);
+			}
+			i = next;
+		}
+	}
+	current = target;
+}
+
+/* milliseconds until the wheel turns, or -1 if no session can expire */
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+int peertimeout(const uint_fast64_t now)
+{
+	if (narmed == 0)
+		return -1;
+	const uint_fast64_t next = (current + 1) * tick;
+	return next > now ? next - now : 0;
+}
+
+/*
+ * Renumber the services of sessions after a reload, closing those whose
+ * service is gone.  Return how many were closed.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+size_t peerremap(const size_t * const map)
+{
+	size_t closed = 0;
+	for (size_t i = 0; i < csessions; i++) {
+		Session * const s = &sessions[i];
+		if (!s->used || s->fd < 0)
+			continue;
+		if (map[s->service] == NONE) {
+			detach(i);
+			closed++;
+		}
+	}
+	for (size_t i = 0; i < csessions; i++) {
+		if (sessions[i].used && sessions[i].service != NONE)
+			sessions[i].service = map[sessions[i].service];
+	}
+	chain();
+	return closed;
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+void peersave(FILE * const state)
+{
+	stateputnum(state, csessions);
+	for (size_t i = 0; i < csessions; i++) {
+		const Session * const s = &sessions[i];
+		stateputnum(state, s->used);
+		if (!s->used)
+			continue;
+		stateputnum(state, s->service);
+		stateputfd(state, s->fd);
+		stateputnum(state, s->last);
+		stateputbytes(state, &s->peer.address, s->peer.length);
+	}
+}
+
+/*
+ * Read the sessions of the previous process, which keep their indices.
+ * Return true on failure.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+bool peerload(FILE * const state, const uint_fast64_t now)
+{
+	uintmax_t n, used, service, last;
+	if (setup(now) || stategetnum(state, &n)
+		|| n >= SIZE_MAX / sizeof *sessions
+		|| (n > 0 && !(sessions = calloc(n, sizeof *sessions))))
+		return true;
+	for (csessions = 0; csessions < n; csessions++) {
+		Session * const s = &sessions[csessions];
+		if (stategetnum(state, &used))
+			return true;
+		if (!used) {
+			s->next = freelist;
+			freelist = csessions;
+			continue;
+		}
+		size_t length;
+		char *address;
+		if (stategetnum(state, &service) || stategetfd(state, &s->fd)
+			|| stategetnum(state, &last)
+			|| !(address = stategetbytes(state, &length)))
+			return true;
+		s->used = true;
+		s->peer.length = length < sizeof s->peer.address ? length
+			: sizeof s->peer.address;
+		memcpy(&s->peer.address, address, s->peer.length);
+		free(address);
+		s->last = last;
+		s->slot = NONE;
+		if ((s->service = cmdadopted(service)) == NONE && s->fd >= 0) {
+			close(s->fd);
+			s->fd = -1;
+		}
+		nopen += s->fd >= 0;
+	}
+	for (size_t i = 0; i < csessions; i++) {
+		if (sessions[i].used && sessions[i].fd >= 0)
+			arm(i);
+	}
+	gauges[GAUGE_PEERS] = nopen;
+	return rehash(64);
+}
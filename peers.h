@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2023 Pierre Colin
+ * This file is part of the serve utility.
+ * 
+ * The serve utility is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * The serve utility is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Peer is declared in dgram.h */
+
+size_t peerfind(size_t service, const Peer *peer)
+#ifdef __GNUC__
+__attribute__((nonnull (2), pure))
+#endif
+;
+
+size_t peeradd(size_t service, const Peer *peer, int fd, uint_fast64_t now)
+#ifdef __GNUC__
+__attribute__((nonnull (2)))
+#endif
+;
+
+bool peersend(size_t session, const char *data, size_t length,
+	uint_fast64_t now)
+#ifdef __GNUC__
+__attribute__((nonnull (2)))
+#endif
+;
+
+void peerend(size_t session);
+
+size_t peerlength(void)
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+;
+
+void peerpoll(struct pollfd *fds)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+int peerrevents(const struct pollfd *fds)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+void peerforward(void);
+
+void peertick(uint_fast64_t now);
+
+int peertimeout(uint_fast64_t now)
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+;
+
+size_t peerremap(const size_t *map)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+void peersave(FILE *state)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+bool peerload(FILE *state, uint_fast64_t now)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
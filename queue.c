@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2023 Pierre Colin
+ * This file is part of the serve utility.
+ * 
+ * The serve utility is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * The serve utility is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "command.h"
+#include "metrics.h"
+#include "remote.h"
+#include "queue.h"
+#include "defer.h"
+#include "sources.h"
+#include "state.h"
+
+/*
+ * Wait times are counted in a histogram whose bucket i holds waits shorter
+ * than 2^i milliseconds and not shorter than half that.  Percentiles are
+ * reported as the upper bound of their bucket.
+ */
+#define NWAITS 32
+
+static Pending *ring;
+static size_t head, length, capacity;
+static uintmax_t waits[NWAITS], nwaits;
+
+static void cleanup(void)
+{
+	for (size_t i = 0; i < length; i++) {
+		const Pending * const p = &ring[(head + i) % capacity];
+		close(p->sock);
+		if (p->input >= 0)
+			close(p->input);
+		free(p->remote);
+	}
+	free(ring);
+}
+
+bool queueinit(const size_t n)
+{
+	if (n == 0)
+		return false;
+	if (!(ring = malloc(n * sizeof *ring)))
+		return true;
+	capacity = n;
+	atexit(cleanup);
+	return false;
+}
+
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+size_t queuelength()
+{
+	return length;
+}
+
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+bool queuefull()
+{
+	return length == capacity;
+}
+
+/* The connection queued i-th from the oldest, or NULL. */
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+Pending *queueat(const size_t i)
+{
+	return i < length ? &ring[(head + i) % capacity] : NULL;
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+void queuepush(const Pending * const pending)
+{
+	ring[(head + length++) % capacity] = *pending;
+	gauges[GAUGE_QUEUE] = length;
+}
+
+/*
+ * Renumber the services of queued connections after a reload, closing those
+ * whose service is gone and choosing again the route of those whose service
+ * is rerouted.  Return how many were closed.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2)))
+#endif
+size_t queueremap(const size_t * const map, const bool * const rerouted)
+{
+	size_t kept = 0;
+	const size_t n = length;
+	for (size_t i = 0; i < n; i++) {
+		Pending p = ring[(head + i) % capacity];
+		if ((p.service = map[p.service]) != SIZE_MAX) {
+			if (rerouted[p.service])
+				deferreroute(&p);
+			ring[(head + kept++) % capacity] = p;
+			continue;
+		}
+		close(p.sock);
+		if (p.input >= 0)
+			close(p.input);
+		free(p.remote);
+		sourcerelease(&p.source);
+	}
+	gauges[GAUGE_QUEUE] = length = kept;
+	return n - kept;
+}
+
+static uintmax_t percentile(const unsigned p)
+{
+	const uintmax_t rank = (nwaits * p + 99) / 100;
+	uintmax_t seen = 0;
+	for (int i = 0; i < NWAITS; i++) {
+		if ((seen += waits[i]) >= rank)
+			return (uintmax_t) 1 << i;
+	}
+	return (uintmax_t) 1 << (NWAITS - 1);
+}
+
+/*
+ * Remove the connection queued i-th from the oldest, keeping the others in
+ * order, and count how long it waited until now.
+ */
+void queueremove(const size_t i, const uint_fast64_t now)
+{
+	uint_fast64_t wait = now - ring[(head + i) % capacity].since;
+	int w = 0;
+	while (wait > 0 && w < NWAITS - 1) {
+		wait >>= 1;
+		w++;
+	}
+	waits[w]++;
+	nwaits++;
+	for (size_t j = i; j > 0; j--)
+		ring[(head + j) % capacity] = ring[(head + j - 1) % capacity];
+	head = (head + 1) % capacity;
+	gauges[GAUGE_QUEUE] = --length;
+	gauges[GAUGE_WAIT_P50] = percentile(50);
+	gauges[GAUGE_WAIT_P90] = percentile(90);
+	gauges[GAUGE_WAIT_P99] = percentile(99);
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2)))
+#endif
+void pendingsave(FILE * const state, const Pending * const p)
+{
+	stateputfd(state, p->sock);
+	stateputfd(state, p->input);
+	stateputbytes(state, p->remote, strlen(p->remote));
+	stateputnum(state, p->source.address);
+	stateputnum(state, p->source.family);
+	stateputnum(state, p->since);
+	stateputnum(state, p->service);
+	stateputnum(state, p->route);
+}
+
+/*
+ * Read a connection saved by pendingsave() by the previous process, counting
+ * it against the limits of its source.  Its service is SIZE_MAX if gone.
+ * Return true on failure.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2)))
+#endif
+bool pendingload(FILE * const state, Pending * const p,
+	const uint_fast64_t now)
+{
+	uintmax_t address, family, since, service, route;
+	size_t n;
+	if (stategetfd(state, &p->sock) || stategetfd(state, &p->input)
+		|| !(p->remote = stategetbytes(state, &n)))
+		return true;
+	if (stategetnum(state, &address) || stategetnum(state, &family)
+		|| stategetnum(state, &since) || stategetnum(state, &service)
+		|| stategetnum(state, &route)) {
+		free(p->remote);
+		return true;
+	}
+	p->source.address = address;
+	p->source.family = family;
+	p->since = since;
+	p->service = cmdadopted(service);
+	p->route = route;
+	sourceadopt(&p->source, now);
+	return false;
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+void queuesave(FILE * const state)
+{
+	stateputnum(state, length);
+	for (size_t i = 0; i < length; i++)
+		pendingsave(state, &ring[(head + i) % capacity]);
+}
+
+/*
+ * Read the connections queued by the previous process, closing those that
+ * do not fit or whose service is gone.  Return true on failure.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+bool queueload(FILE * const state, const uint_fast64_t now)
+{
+	uintmax_t n;
+	if (stategetnum(state, &n))
+		return true;
+	for (uintmax_t i = 0; i < n; i++) {
+		Pending p;
+		if (pendingload(state, &p, now))
+			return true;
+		if (p.service != SIZE_MAX && !queuefull()) {
+			queuepush(&p);
+			continue;
+		}
+		close(p.sock);
+		if (p.input >= 0)
+			close(p.input);
+		free(p.remote);
+		sourcerelease(&p.source);
+	}
+	return false;
+}
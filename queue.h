@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2023 Pierre Colin
+ * This file is part of the serve utility.
+ * 
+ * The serve utility is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * The serve utility is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * SourceKey is declared in remote.h; input is the pre-read request to be
+ * given as standard input instead of sock, or -1, service the index of the
+ * service which accepted the connection and route that of the route whose
+ * command it runs, or SIZE_MAX for the command of the service.
+ */
+typedef struct {
+	int sock, input;
+	char *remote;
+	SourceKey source;
+	uint_fast64_t since;
+	size_t service, route;
+} Pending;
+
+bool queueinit(size_t capacity);
+
+size_t queuelength(void)
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+;
+
+bool queuefull(void)
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+;
+
+Pending *queueat(size_t i)
+#ifdef __GNUC__
+__attribute__((pure))
+#endif
+;
+
+void queuepush(const Pending *pending)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+void queueremove(size_t i, uint_fast64_t now);
+
+size_t queueremap(const size_t *map, const bool *rerouted)
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2)))
+#endif
+;
+
+void pendingsave(FILE *state, const Pending *p)
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2)))
+#endif
+;
+
+bool pendingload(FILE *state, Pending *p, uint_fast64_t now)
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2)))
+#endif
+;
+
+void queuesave(FILE *state)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+bool queueload(FILE *state, uint_fast64_t now)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
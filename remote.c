@@ -15,6 +15,10 @@
  * You should have received a copy of the GNU General Public License along with
  * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
  */
+#ifdef __linux__
+/* for struct ucred */
+#define _GNU_SOURCE
+#endif
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
@@ -28,6 +32,8 @@
 #include <sys/un.h>
 #include <unistd.h>
 
+#include "remote.h"
+
 #define BUF_LEN 512
 
 #ifdef __GNUC__
@@ -79,10 +85,96 @@ static char *serializeunix(const struct sockaddr_un * const restrict address)
 	return path2 ? path2 : path;
 }
 
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+static uint_least64_t bigendian(const unsigned char * const restrict bytes,
+	const int n)
+{
+	uint_least64_t x = 0;
+	for (int i = 0; i < n; i++)
+		x = x << 8 | bytes[i];
+	return x;
+}
+
 #ifdef __GNUC__
 __attribute__((nonnull (2)))
 #endif
-int acceptremote(const int socket, char ** const restrict address)
+static void getsource(const int fildes, const struct sockaddr * const buf,
+	SourceKey * const restrict source)
+{
+	source->family = buf->sa_family;
+	source->address = 0;
+	switch (buf->sa_family) {
+	case AF_INET: {
+		const struct sockaddr_in * const in = (const void *) buf;
+		source->address = ntohl(in->sin_addr.s_addr);
+		break;
+	}
+	case AF_INET6: {
+		const struct sockaddr_in6 * const in6 = (const void *) buf;
+		const unsigned char * const b = in6->sin6_addr.s6_addr;
+		if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+			source->family = AF_INET;
+			source->address = bigendian(b + 12, 4);
+		} else {
+			source->address = bigendian(b, 8);
+		}
+		break;
+	}
+	case AF_UNIX: {
+#if defined(SO_PEERCRED)
+		struct ucred cred;
+		socklen_t len = sizeof cred;
+		if (getsockopt(fildes, SOL_SOCKET, SO_PEERCRED, &cred, &len)
+			== 0)
+			source->address = cred.uid;
+#elif defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) \
+	|| defined(__APPLE__)
+		uid_t uid;
+		gid_t gid;
+		if (getpeereid(fildes, &uid, &gid) == 0)
+			source->address = uid;
+#else
+		/* all Unix domain peers share one source */
+		(void) fildes;
+#endif
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+/*
+ * Return the string form of address, a peer of socket, and set its source, or
+ * return NULL on failure.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (2, 3)))
+#endif
+char *describeremote(const int socket, const struct sockaddr * const address,
+	SourceKey * const restrict source)
+{
+	getsource(socket, address, source);
+	switch (address->sa_family) {
+	case AF_INET:
+		return serializeinet((const struct sockaddr_in *) address);
+	case AF_INET6:
+		return serializeinet6((const struct sockaddr_in6 *) address);
+	case AF_UNIX:
+		return serializeunix((const struct sockaddr_un *) address);
+	default:
+		errno = ENOTSUP;
+		return NULL;
+	}
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (2, 3)))
+#endif
+int acceptremote(const int socket, char ** const restrict address,
+	SourceKey * const restrict source)
 {
 	assert(sizeof (struct sockaddr_in) <= BUF_LEN);
 	assert(sizeof (struct sockaddr_in6) <= BUF_LEN);
@@ -92,29 +184,12 @@ int acceptremote(const int socket, char ** const restrict address)
 	const int fildes = accept(socket, (struct sockaddr *) buf, &length);
 	if (fildes < 0)
 		return -1;
-	switch (((struct sockaddr *) buf)->sa_family) {
-	case AF_INET:
-		if (!(*address = serializeinet((struct sockaddr_in *) buf)))
-			goto fail;
-		return fildes;
-	case AF_INET6:
-		if (!(*address = serializeinet6((struct sockaddr_in6 *) buf)))
-			goto fail;
-		return fildes;
-	case AF_UNIX:
-		if (!(*address = serializeunix((struct sockaddr_un *) buf)))
-			goto fail;
-		return fildes;
-	default:
+	if (!(*address = describeremote(fildes, (struct sockaddr *) buf,
+		source))) {
+		const int error = errno;
 		close(fildes);
-		errno = ENOTSUP;
+		errno = error;
 		return -1;
 	}
-
-	int error;
-fail:
-	error = errno;
-	close(fildes);
-	errno = error;
-	return -1;
+	return fildes;
 }
@@ -15,8 +15,28 @@
  * You should have received a copy of the GNU General Public License along with
  * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
  */
-int acceptremote(int socket, char **address)
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+ * Identity of a peer for per-source limits: the IPv4 address, the first 64
+ * bits of the IPv6 address or the user ID of a Unix domain peer, along with
+ * the address family.
+ */
+typedef struct {
+	uint_least64_t address;
+	int family;
+} SourceKey;
+
+char *describeremote(int socket, const struct sockaddr *address,
+	SourceKey *source)
+#ifdef __GNUC__
+__attribute__((nonnull (2, 3)))
+#endif
+;
+
+int acceptremote(int socket, char **address, SourceKey *source)
 #ifdef __GNUC__
-__attribute__((nonnull (2)))
+__attribute__((nonnull (2, 3)))
 #endif
 ;
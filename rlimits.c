@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2023 Pierre Colin
+ * This file is part of the serve utility.
+ * 
+ * The serve utility is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * The serve utility is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifdef __linux__
+/* for syscall() */
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include <unistd.h>
+
+#include "command.h"
+#include "rlimits.h"
+
+#ifdef __linux__
+/* from linux/ioprio.h, which is not installed everywhere */
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+#endif
+
+/*
+ * Everything worker processes apply between fork() and exec() is computed
+ * once by rlimitsinit() so that the child only makes system calls.
+ */
+static struct {
+	int resource;
+	struct rlimit limit;
+	const char *name;
+} limits[3];
+static size_t nlimits;
+#ifdef __linux__
+static int ioprio;
+#endif
+
+#ifdef __GNUC__
+__attribute__((nonnull (3)))
+#endif
+static void addlimit(const int resource, const rlim_t value,
+	const char * const restrict name)
+{
+	if (value == 0)
+		return;
+	limits[nlimits].resource = resource;
+	limits[nlimits].limit.rlim_cur = value;
+	limits[nlimits].limit.rlim_max = value;
+	limits[nlimits++].name = name;
+}
+
+void rlimitsinit()
+{
+	const WorkerLimits * const opts = getworkerlimits();
+	addlimit(RLIMIT_CPU, opts->cpu, "CPU time");
+	const rlim_t mib = (rlim_t) 1 << 20;
+	addlimit(RLIMIT_AS, opts->as > RLIM_INFINITY / mib ? RLIM_INFINITY
+		: opts->as * mib, "address space");
+	addlimit(RLIMIT_NOFILE, opts->nofile, "open files");
+#ifdef __linux__
+	if (opts->ioclass != IOCLASS_NONE)
+		ioprio = opts->ioclass << IOPRIO_CLASS_SHIFT | opts->iolevel;
+#endif
+}
+
+/*
+ * Write the concatenation of what and name to standard error with write() only
+ * so as to remain async-signal-safe, leaving errno for the caller to report.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull))
+#endif
+static void complain(const char * const restrict what,
+	const char * const restrict name)
+{
+	const int e = errno;
+	(void) write(STDERR_FILENO, what, strlen(what));
+	(void) write(STDERR_FILENO, name, strlen(name));
+	(void) write(STDERR_FILENO, "\n", 1);
+	errno = e;
+}
+
+/*
+ * Apply the limits to the calling process, a forked child of a possibly
+ * multithreaded one.  Return true with errno set on failure.
+ */
+bool rlimitsapply()
+{
+	for (size_t i = 0; i < nlimits; i++) {
+		if (setrlimit(limits[i].resource, &limits[i].limit) < 0) {
+			complain("Could not limit ", limits[i].name);
+			return true;
+		}
+	}
+	const WorkerLimits * const opts = getworkerlimits();
+	if (opts->setnice && setpriority(PRIO_PROCESS, 0, opts->nice) < 0) {
+		complain("Could not set ", "nice value");
+		return true;
+	}
+#if defined(__linux__) && defined(SYS_ioprio_set)
+	if (ioprio != 0 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+		ioprio) < 0) {
+		complain("Could not set ", "I/O priority");
+		return true;
+	}
+#endif
+	return false;
+}
@@ -15,16 +15,21 @@
  * You should have received a copy of the GNU General Public License along with
  * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
  */
+#include <errno.h>
 #include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "command.h"
+#include "log.h"
+#include "metrics.h"
 
+int reload(void);
 int resume(void);
+int upgrade(char * const argv[]);
 
-static volatile sig_atomic_t done;
+static volatile sig_atomic_t done, hangup, reopen, report, replace;
 
 static void interrupt(const int signum)
 {
@@ -32,6 +37,30 @@ static void interrupt(const int signum)
 	done = 1;
 }
 
+static void hang(const int signum)
+{
+	(void) signum;
+	hangup = 1;
+}
+
+static void askreopen(const int signum)
+{
+	(void) signum;
+	reopen = 1;
+}
+
+static void askreport(const int signum)
+{
+	(void) signum;
+	report = 1;
+}
+
+static void askupgrade(const int signum)
+{
+	(void) signum;
+	replace = 1;
+}
+
 static void confsig()
 {
 	struct sigaction sa;
@@ -39,13 +68,44 @@ static void confsig()
 	sigemptyset(&sa.sa_mask);
 	sa.sa_flags = SA_RESETHAND;
 	sigaction(SIGINT, &sa, NULL);
+	sa.sa_handler = hang;
+	sa.sa_flags = 0;
+	sigaction(SIGHUP, &sa, NULL);
+	sa.sa_handler = askreopen;
+	sigaction(SIGWINCH, &sa, NULL);
+	sa.sa_handler = askreport;
+	sigaction(SIGUSR1, &sa, NULL);
+	sa.sa_handler = askupgrade;
+	sigaction(SIGUSR2, &sa, NULL);
 }
 
 int main(int argc, char *argv[])
 {
 	init(argc, argv);
+	if (loginit()) {
+		perror("Could not start the log writer");
+		return EXIT_FAILURE;
+	}
 	confsig();
 	while (!done) {
+		if (reopen) {
+			reopen = 0;
+			logreopen();
+		}
+		if (hangup) {
+			hangup = 0;
+			if (reload() < 0 && errno != ENOENT)
+				perror("Could not reload the configuration");
+		}
+		if (replace) {
+			replace = 0;
+			upgrade(argv);
+			perror("Could not upgrade");
+		}
+		if (report) {
+			report = 0;
+			logmetrics();
+		}
 		const int r = resume();
 		if (r < 0)
 			perror("Internal error while running the executor");
@@ -26,25 +26,71 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "breaker.h"
+#include "bucket.h"
 #include "command.h"
+#include "limiter.h"
+#include "log.h"
+#include "metrics.h"
+#include "overload.h"
 #include "remote.h"
+#include "rlimits.h"
+#include "queue.h"
+#include "defer.h"
+#include "dgram.h"
+#include "handoff.h"
+#include "peers.h"
+#include "sockopts.h"
+#include "sources.h"
+#include "state.h"
+
+/* milliseconds between two summaries of dropped error lines */
+#define DROP_REPORT_PERIOD 1000
+
+/*
+ * fixed entries of fds preceding those of worker processes, which are
+ * followed by those of listeners and of connections waiting for data
+ */
+enum {SIGNALS, NFIXED};
+
+extern char **environ;
 
 typedef struct {
 	pid_t pid;
 	char *ebuf;
 	size_t nebuf, cebuf;
+	Bucket lines, bytes;
+	uintmax_t dropped;
+	bool skip, raw;
+	SourceKey source;
+	uint_fast64_t start;
+	size_t service;
+	/* job of the datagrams the worker answers, or SIZE_MAX */
+	size_t job;
+	/* session of the datagram peer the worker serves, or SIZE_MAX */
+	size_t peer;
 } ProcessData;
 
 static ProcessData *processes;
 static struct pollfd *fds;
 static size_t nproc, cproc = 0;
+/* sessions running, connections queued and poll events of each service */
+static size_t *running, *queued;
+static short *incoming;
+static Bucket totallines, totalbytes, spawns;
+/* now is in milliseconds, nowus in microseconds */
+static uint_fast64_t now, nowus, lastreport;
+static bool dropping;
+static int sigpipe[2] = {-1, -1};
 
 static void cleanupprocesses()
 {
 	for (size_t i = 0; i < nproc; i++) {
-		close(fds[i + 1].fd);
+		if (fds[NFIXED + i].fd >= 0)
+			close(fds[NFIXED + i].fd);
 		free(processes[i].ebuf);
 	}
 }
@@ -54,6 +100,11 @@ static void cleanup(void)
 	cleanupprocesses();
 	free(processes);
 	free(fds);
+	free(running);
+	free(queued);
+	free(incoming);
+	close(sigpipe[0]);
+	close(sigpipe[1]);
 }
 
 bool mknonblocking(const int fildes)
@@ -62,6 +113,69 @@ bool mknonblocking(const int fildes)
 	return !(flags < 0 || fcntl(fildes, F_SETFL, flags | O_NONBLOCK) < 0);
 }
 
+bool mkcloexec(const int fildes)
+{
+	const int flags = fcntl(fildes, F_GETFD);
+	return !(flags < 0 || fcntl(fildes, F_SETFD, flags | FD_CLOEXEC) < 0);
+}
+
+static void notifychild(const int signum)
+{
+	(void) signum;
+	const int error = errno;
+	(void) write(sigpipe[1], "", 1);
+	errno = error;
+}
+
+/*
+ * Wake up the event loop whenever a worker process terminates, since workers
+ * whose standard error is not forwarded have no pipe to report it.
+ */
+static bool watchchildren(void)
+{
+	if (pipe(sigpipe) < 0)
+		return true;
+	for (int i = 0; i < 2; i++) {
+		if (!mkcloexec(sigpipe[i]) || !mknonblocking(sigpipe[i]))
+			return true;
+	}
+	struct sigaction sa;
+	sa.sa_handler = notifychild;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_NOCLDSTOP;
+	return sigaction(SIGCHLD, &sa, NULL) < 0;
+}
+
+static int drainsignals(void)
+{
+	if (!(fds[SIGNALS].revents & POLLIN))
+		return 0;
+	char buf[64];
+	while (read(fds[SIGNALS].fd, buf, sizeof buf) > 0)
+		continue;
+	return 1;
+}
+
+static uint_fast64_t getnow(void)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return now;
+	logtick(&ts);
+	nowus = (uint_fast64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	return nowus / 1000;
+}
+
+/*
+ * Return how many entries fds needs for ns services and n workers, each of
+ * which may serve a datagram peer polled after the listeners and waiting
+ * connections, and before the backends of the -H option.
+ */
+static size_t pollsize(const size_t ns, const size_t n)
+{
+	return NFIXED + ns + defersize() + 2 * n + handoffsize();
+}
+
 static bool allocproc()
 {
 	if (nproc < cproc)
@@ -71,8 +185,9 @@ static bool allocproc()
 		2 * cproc;
 	if (ns >= SIZE_MAX / sizeof (ProcessData))
 		ns = SIZE_MAX / sizeof (ProcessData) - 1;
-	if (ns >= SIZE_MAX / sizeof (struct pollfd) - 1)
-		ns = SIZE_MAX / sizeof (struct pollfd) - 2;
+	const size_t fixed = pollsize(getnservices(), 0);
+	if (ns >= (SIZE_MAX / sizeof (struct pollfd) - fixed) / 2)
+		ns = (SIZE_MAX / sizeof (struct pollfd) - fixed) / 2 - 1;
 	if (ns <= cproc) {
 		errno = ENOMEM;
 		return true;
@@ -81,7 +196,8 @@ static bool allocproc()
 	if (!newptr)
 		return true;
 	processes = newptr;
-	newptr = realloc(fds, (ns + 1) * sizeof (struct pollfd));
+	newptr = realloc(fds, pollsize(getnservices(), ns)
+		* sizeof (struct pollfd));
 	if (!newptr)
 		return true;
 	fds = newptr;
@@ -89,45 +205,177 @@ static bool allocproc()
 	return false;
 }
 
-static bool addproc(const int sock, const char * const restrict remote)
+/*
+ * Wait until the worker pid either runs its command, closing the close-on-exec
+ * end of report it holds, or writes why it could not.  Return true with errno
+ * set to the reason in the latter case, once the worker is reaped.
+ */
+static bool execfailed(const pid_t pid, const int report)
 {
-	int fd[2];
-	if (pipe(fd) < 0)
+	int e;
+	ssize_t n;
+	while ((n = read(report, &e, sizeof e)) < 0 && errno == EINTR)
+		continue;
+	if (n != sizeof e)
+		return false;
+	while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+		continue;
+	errno = e;
+	return true;
+}
+
+/*
+ * Environment of a worker of client remote, that of this process with $REMOTE
+ * set, allocated at once so that free() releases it.  Return NULL on failure.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull))
+#endif
+static char **mkenviron(const char * const restrict remote)
+{
+	static const char name[] = "REMOTE=";
+	size_t n = 0;
+	while (environ[n])
+		n++;
+	const size_t len = strlen(remote);
+	char ** const env = malloc((n + 2) * sizeof *env + sizeof name + len);
+	if (!env)
+		return NULL;
+	char * const var = (char *) (env + n + 2);
+	memcpy(var, name, sizeof name - 1);
+	memcpy(var + sizeof name - 1, remote, len + 1);
+	size_t m = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (strncmp(environ[i], name, sizeof name - 1) != 0)
+			env[m++] = environ[i];
+	}
+	env[m++] = var;
+	env[m] = NULL;
+	return env;
+}
+
+/*
+ * Create a worker process running the command of route of service, or that of
+ * service if route is SIZE_MAX, on sock.  Return true on failure.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (5, 6)))
+#endif
+static bool addproc(const size_t service, const size_t route, const int sock,
+	const int input, const char * const restrict remote,
+	const SourceKey * const restrict source)
+{
+	/* standard error goes either to a pipe or straight to errfd */
+	const Service * const svc = getservice(service);
+	const int mode = svc->errormode;
+	const int errfd = mode == ERRORS_DIRECT ? svc->errorfd : -1;
+	int fd[2] = {-1, -1};
+	/* the worker reports there why it could not run the command */
+	int report[2] = {-1, -1};
+	if (errfd < 0 && pipe(fd) < 0)
 		return true;
-	if (!mknonblocking(fd[1]) || allocproc())
-		goto cleanup_pipe;
-	if ((processes[nproc].pid = fork()) < 0)
+	char **env = NULL;
+	if ((fd[1] >= 0 && !mknonblocking(fd[1])) || allocproc()
+		|| !(env = mkenviron(remote)) || pipe(report) < 0
+		|| !mkcloexec(report[0]) || !mkcloexec(report[1]))
 		goto cleanup_pipe;
+	processes[nproc].pid = fork();
 	if (processes[nproc].pid == 0) {
-		cleanupprocesses();
-		nproc = 0;
-		if (setenv("REMOTE", remote, 1) < 0)
-			perror("Could not set $REMOTE in child process");
-		dup2(sock, STDIN_FILENO);
+		/* only async-signal-safe functions until exec */
+		for (size_t i = 0; i < nproc; i++) {
+			if (fds[NFIXED + i].fd >= 0)
+				close(fds[NFIXED + i].fd);
+		}
+		dup2(input >= 0 ? input : sock, STDIN_FILENO);
 		dup2(sock, STDOUT_FILENO);
-		dup2(fd[1], STDERR_FILENO);
+		dup2(errfd < 0 ? fd[1] : errfd, STDERR_FILENO);
 		close(sock);
-		close(fd[0]);
-		close(fd[1]);
-		cmdexec();
-		perror("Could not start child process");
-		abort();
+		if (errfd < 0) {
+			close(fd[0]);
+			close(fd[1]);
+		}
+		close(report[0]);
+		const bool applied = !rlimitsapply();
+		if (applied)
+			cmdexec(service, route, env);
+		const int e = errno;
+		(void) write(report[1], &e, sizeof e);
+		_exit(applied ? 127 : 126);
 	}
-	close(fd[1]);
+	free(env);
+	env = NULL;
+	if (processes[nproc].pid < 0)
+		goto cleanup_pipe;
+	close(report[1]);
+	report[1] = -1;
+	const bool failed = execfailed(processes[nproc].pid, report[0]);
+	const int e = errno;
+	close(report[0]);
+	if (failed) {
+		counters[COUNT_EXEC_FAILED]++;
+		breakerstart(processes[nproc].pid, now);
+		breakerend(processes[nproc].pid, true, 0, now);
+		if (errfd < 0) {
+			close(fd[0]);
+			close(fd[1]);
+		}
+		errno = e;
+		return true;
+	}
+	if (errfd < 0)
+		close(fd[1]);
+	const LogOptions * const limits = getlogoptions();
 	processes[nproc].ebuf = NULL;
 	processes[nproc].nebuf = processes[nproc].cebuf = 0;
-	fds[nproc + 1].fd = fd[0];
-	fds[nproc + 1].events = POLLIN;
-	printf("Process %ju created (%s)\n",
+	bucketinit(&processes[nproc].lines, limits->lines, limits->lines, now);
+	bucketinit(&processes[nproc].bytes, limits->bytes, limits->bytes, now);
+	processes[nproc].dropped = 0;
+	processes[nproc].skip = false;
+	processes[nproc].raw = mode == ERRORS_RAW;
+	processes[nproc].source = *source;
+	processes[nproc].start = nowus;
+	processes[nproc].service = service;
+	processes[nproc].job = SIZE_MAX;
+	processes[nproc].peer = SIZE_MAX;
+	running[service]++;
+	fds[NFIXED + nproc].fd = fd[0];
+	fds[NFIXED + nproc].events = POLLIN;
+	fds[NFIXED + nproc].revents = 0;
+	logprintf("Process %ju created (%s)\n",
 		(uintmax_t) processes[nproc++].pid, remote);
+	buckettake(&spawns, 1);
+	breakerstart(processes[nproc - 1].pid, now);
+	counters[COUNT_CREATED]++;
+	gauges[GAUGE_SESSIONS] = nproc;
 	return false;
 
-cleanup_pipe:
-	close(fd[0]);
-	close(fd[1]);
+cleanup_pipe:;
+	const int pe = errno;
+	free(env);
+	if (errfd < 0) {
+		close(fd[0]);
+		close(fd[1]);
+	}
+	if (report[0] >= 0) {
+		close(report[0]);
+		close(report[1]);
+	}
+	errno = pe;
 	return true;
 }
 
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+static void reportdrops(ProcessData * const proc)
+{
+	if (proc->dropped == 0)
+		return;
+	logprintf("%ju lines dropped from pid %ju\n", proc->dropped,
+		(uintmax_t) proc->pid);
+	proc->dropped = 0;
+}
+
 static bool needrmproc(const size_t p)
 {
 	int x;
@@ -135,20 +383,78 @@ static bool needrmproc(const size_t p)
 	if (pid <= 0)
 		return false;
 	if (processes[p].nebuf > 0) {
-		fprintf(stderr, "%ju: %s\n", (uintmax_t) processes[p].pid,
+		logprintf("%ju: %s\n", (uintmax_t) processes[p].pid,
 			processes[p].ebuf);
 		processes[p].ebuf[0] = 0;
 		processes[p].nebuf = 0;
 	}
-	printf("Process %ju exited (%d)\n", (uintmax_t) pid, x);
+	reportdrops(&processes[p]);
+	limitersample(nowus - processes[p].start, nproc);
+	const bool failed = !WIFEXITED(x) || WEXITSTATUS(x) != 0;
+	breakerend(pid, failed, (nowus - processes[p].start) / 1000, now);
+	logprintf("Process %ju exited (%d)\n", (uintmax_t) pid, x);
 	return true;
 }
 
+/* Whether all buckets hold enough tokens to forward a line of len bytes. */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+static bool canforward(ProcessData * const proc, const uint_fast32_t len)
+{
+	return bucketcan(&proc->lines, 1, now)
+		&& bucketcan(&totallines, 1, now)
+		&& bucketcan(&proc->bytes, len, now)
+		&& bucketcan(&totalbytes, len, now);
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+static bool admitline(ProcessData * const proc, const size_t len)
+{
+	if (!canforward(proc, len + 1)) {
+		proc->dropped++;
+		dropping = true;
+		return false;
+	}
+	buckettake(&proc->lines, 1);
+	buckettake(&totallines, 1);
+	buckettake(&proc->bytes, len + 1);
+	buckettake(&totalbytes, len + 1);
+	return true;
+}
+
+/*
+ * Read and discard error output without buffering it, only counting the lines
+ * it ends.  This keeps the worker from blocking on a full pipe while its
+ * output is over the limits.
+ */
+static bool drainprocerror(const size_t p)
+{
+	ProcessData * const proc = &processes[p];
+	char buf[4096];
+	const ssize_t n = read(fds[NFIXED + p].fd, buf, sizeof buf);
+	if (n <= 0)
+		return n < 0;
+	for (const char *c = buf; (c = memchr(c, '\n', buf + n - c)); c++)
+		proc->dropped++;
+	if (proc->nebuf > 0) {
+		proc->ebuf[0] = 0;
+		proc->nebuf = 0;
+	}
+	proc->skip = buf[n - 1] != '\n';
+	dropping = true;
+	return false;
+}
+
 static bool passprocerror(const size_t p)
 {
 	/* strictly-conforming upper bound for error line buffer */
 	static const size_t max_cebuf = 65534;
 	ProcessData * const proc = &processes[p];
+	if (!canforward(proc, 1))
+		return drainprocerror(p);
 	if (proc->nebuf + 128 > proc->cebuf) {
 		if (proc->nebuf > max_cebuf - 128) {
 			errno = ENOMEM;
@@ -161,7 +467,7 @@ static bool passprocerror(const size_t p)
 		proc->ebuf = newbuf;
 	}
 	char * const resume = proc->ebuf + proc->nebuf;
-	const ssize_t n = read(fds[p + 1].fd, resume, 128);
+	const ssize_t n = read(fds[NFIXED + p].fd, resume, 128);
 	if (n < 0)
 		return true;
 	resume[n] = 0;
@@ -169,34 +475,96 @@ static bool passprocerror(const size_t p)
 	char *lf = strchr(resume, '\n');
 	while (lf) {
 		*lf = 0;
-		printf("%ju: %s\n", (uintmax_t) proc->pid, proc->ebuf);
+		if (proc->skip) {
+			proc->skip = false;
+			proc->dropped++;
+		} else if (admitline(proc, lf - proc->ebuf)) {
+			logprintf("%ju: %s\n", (uintmax_t) proc->pid,
+				proc->ebuf);
+		}
 		proc->nebuf -= lf - proc->ebuf + 1;
 		memmove(proc->ebuf, lf + 1, proc->nebuf + 1);
 		lf = strchr(proc->ebuf, '\n');
 	}
+	if (proc->skip) {
+		proc->ebuf[0] = 0;
+		proc->nebuf = 0;
+	}
+	return false;
+}
+
+/*
+ * Forward error output as is, within the byte limits.  Bytes move straight
+ * from the worker pipe to the log when logsplice() can, and are copied
+ * through a buffer otherwise.
+ */
+static bool passprocraw(const size_t p)
+{
+	ProcessData * const proc = &processes[p];
+	const int fd = fds[NFIXED + p].fd;
+	char buf[4096];
+	size_t quota = bucketlevel(&proc->bytes, now);
+	const uint_fast32_t total = bucketlevel(&totalbytes, now);
+	if (quota > total)
+		quota = total;
+	if (quota == 0)
+		return drainprocerror(p);
+	ssize_t n = logsplice(fd, quota < 65536 ? quota : 65536);
+	if (n < 0 && errno != EAGAIN && errno != EINVAL)
+		return true;
+	if (n < 0) {
+		if ((n = read(fd, buf, quota < sizeof buf ? quota : sizeof buf))
+			< 0)
+			return true;
+		if (n > 0 && logwrite(buf, n)) {
+			/* the log is behind: count what is lost like a drain */
+			for (const char *c = buf;
+				(c = memchr(c, '\n', buf + n - c)); c++)
+				proc->dropped++;
+			dropping = true;
+			return false;
+		}
+	}
+	buckettake(&proc->bytes, n);
+	buckettake(&totalbytes, n);
 	return false;
 }
 
 static int passprocio(const size_t p)
 {
-	if (fds[p + 1].revents & POLLERR) {
+	if (fds[NFIXED + p].revents & POLLERR) {
 		fprintf(stderr, "Process %ju has a pipe error\n",
 			(uintmax_t) processes[p].pid);
 		return -1;
 	}
 
-	if (fds[p + 1].revents & POLLIN)
-		return passprocerror(p) ? -1 : 1;
+	if (fds[NFIXED + p].revents & POLLIN) {
+		const bool e = processes[p].raw ? passprocraw(p)
+			: passprocerror(p);
+		return e ? -1 : 1;
+	}
 
 	return 0;
 }
 
 static void rmproc(const size_t p)
 {
-	close(fds[p + 1].fd);
+	if (fds[NFIXED + p].fd >= 0)
+		close(fds[NFIXED + p].fd);
 	free(processes[p].ebuf);
-	processes[p] = processes[nproc - 1];
-	fds[p + 1] = fds[nproc--];
+	sourcerelease(&processes[p].source);
+	/* sessions of services removed by a reload are not counted */
+	if (processes[p].service != SIZE_MAX)
+		running[processes[p].service]--;
+	if (processes[p].job != SIZE_MAX)
+		dgramfinish(processes[p].job, processes[p].service == SIZE_MAX
+			? -1 : getservice(processes[p].service)->listener);
+	if (processes[p].peer != SIZE_MAX)
+		peerend(processes[p].peer);
+	processes[p] = processes[--nproc];
+	fds[NFIXED + p] = fds[NFIXED + nproc];
+	counters[COUNT_EXITED]++;
+	gauges[GAUGE_SESSIONS] = nproc;
 }
 
 #ifdef __GNUC__
@@ -207,27 +575,679 @@ static int propagateacceptfailure(const int error)
 	return error != ECONNABORTED && error != EINTR && error != EMFILE;
 }
 
+/* Whether both the global limit and that of service allow a session. */
+static bool haveslot(const size_t service)
+{
+	const uint_fast32_t max = sessionlimit();
+	const uint_fast32_t own = getservice(service)->maxsessions;
+	return (max == 0 || nproc < max)
+		&& (own == 0 || running[service] < own);
+}
+
+/* Whether creating a worker process now would exceed the spawn rate. */
+static bool throttled(void)
+{
+	return !bucketcan(&spawns, 1, now);
+}
+
+/* How many sessions of service can start right now. */
+static size_t freeslots(const size_t service)
+{
+	const uint_fast32_t max = sessionlimit();
+	const uint_fast32_t own = getservice(service)->maxsessions;
+	size_t n = SIZE_MAX;
+	if (max > 0)
+		n = nproc < max ? max - nproc : 0;
+	if (own > 0 && own - running[service] < n)
+		n = running[service] < own ? own - running[service] : 0;
+	if (getspawnlimit()->rate > 0 && bucketlevel(&spawns, now) < n)
+		n = bucketlevel(&spawns, now);
+	return n;
+}
+
+/*
+ * Whether connections to service are to wait where they are, in the backlog
+ * or among those waiting for data: there is neither a session to start nor
+ * room in the queue, they are not to be shed instead, and no backend may take
+ * them if handoff tells they could be handed over.
+ */
+static bool mustwait(const size_t service, const bool handoff)
+{
+	const bool full = !haveslot(service) && !getoverload()->full;
+	return queuefull() && (full || throttled())
+		&& (!handoff || handoffbackends() == 0);
+}
+
+/* Whether the connection pending that sent data is to wait for a session. */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+static bool blocked(const Pending * const pending)
+{
+	return mustwait(pending->service, pending->route == SIZE_MAX
+		&& pending->input < 0);
+}
+
+/* Count the queued connections of each service anew. */
+static void countqueued(void)
+{
+	memset(queued, 0, getnservices() * sizeof *queued);
+	const Pending *p;
+	for (size_t i = 0; (p = queueat(i)); i++)
+		queued[p->service]++;
+}
+
+/*
+ * Start the sessions of queued connections while there are free slots, and
+ * turn down those that waited too long or arrive while the breaker is open.
+ * Connections of services with no free slot let those of others pass.
+ */
+static void dispatchqueue(void)
+{
+	const QueueOptions * const opts = getqueueoptions();
+	const uint_fast32_t max = sessionlimit();
+	Pending *p;
+	for (size_t i = 0; (p = queueat(i)); /* noop */) {
+		const bool expired = opts->timeout > 0
+			&& now - p->since >= opts->timeout;
+		/* no service can start a session */
+		if (!expired && (throttled() || (max > 0 && nproc >= max)))
+			break;
+		if (!expired && !haveslot(p->service)) {
+			i++;
+			continue;
+		}
+		if (expired) {
+			if (opts->reply)
+				shed(p->sock);
+			sourcerelease(&p->source);
+			counters[COUNT_EXPIRED]++;
+		} else if (!breakerallows(now)) {
+			shed(p->sock);
+			sourcerelease(&p->source);
+			counters[COUNT_SHED_BREAKER]++;
+		} else if (addproc(p->service, p->route, p->sock, p->input,
+			p->remote, &p->source)) {
+			fprintf(stderr,
+				"Could not start queued session (%s): %s\n",
+				p->remote, strerror(errno));
+			sourcerelease(&p->source);
+		}
+		close(p->sock);
+		if (p->input >= 0)
+			close(p->input);
+		free(p->remote);
+		queued[p->service]--;
+		queueremove(i, now);
+	}
+}
+
+/*
+ * Start the session of a connection admitted by its source, queue it or turn
+ * it down.  Return true on failure.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (5, 6)))
+#endif
+static bool startsession(const size_t service, const size_t route,
+	const int s, const int input, char * const a,
+	const SourceKey * const source)
+{
+	const bool wait = throttled();
+	const bool slot = haveslot(service) && !wait && queued[service] == 0;
+	/* connections deferred by the spawn rate are not shed */
+	const bool full = !haveslot(service) && queuefull();
+	int reason;
+	bool error = false;
+	/*
+	 * Backends take connections that would run the command of their
+	 * service with the socket as input, told which service by its index;
+	 * routed and pre-read connections need their worker.
+	 */
+	if (route == SIZE_MAX && input < 0 && !handoffsend(s, service, a)) {
+		sourcerelease(source);
+	} else if ((reason = overloaded(getservice(service)->listener, full,
+		queuelength(), now)) >= 0) {
+		shed(s);
+		sourcerelease(source);
+		counters[reason]++;
+	} else if (!slot && !queuefull()) {
+		/* queued sockets must not leak into workers */
+		if (!mkcloexec(s)) {
+			error = true;
+			sourcerelease(source);
+		} else {
+			const Pending p = {
+				s, input, a, *source, now, service, route
+			};
+			queuepush(&p);
+			queued[service]++;
+			counters[COUNT_QUEUED]++;
+			counters[COUNT_THROTTLED] += wait;
+			return false;
+		}
+	} else if (!haveslot(service) || wait) {
+		/* no backend took it after all, and limits still hold */
+		shed(s);
+		sourcerelease(source);
+		counters[COUNT_SHED_SESSIONS]++;
+	} else if (!breakerallows(now)) {
+		shed(s);
+		sourcerelease(source);
+		counters[COUNT_SHED_BREAKER]++;
+	} else if (addproc(service, route, s, input, a, source)) {
+		error = true;
+		sourcerelease(source);
+	}
+	const int e = errno;
+	free(a);
+	close(s);
+	if (input >= 0)
+		close(input);
+	errno = e;
+	return error;
+}
+
+/*
+ * Accept a connection on service and start its session unless it must wait
+ * for data or its source is over limit.  Return true on failure.
+ */
+static bool acceptconnection(const size_t service)
+{
+	char *a;
+	SourceKey source;
+	const int s = acceptremote(getservice(service)->listener, &a, &source);
+	if (s < 0)
+		return propagateacceptfailure(errno);
+	counters[COUNT_ACCEPTED]++;
+	sockoptsaccept(s, getservice(service));
+	const bool wait = deferwait(service) > 0;
+	size_t route = SIZE_MAX;
+	int data = 1;
+	if (!sourceadmit(&source, now)) {
+		logprintf("Connection refused (%s): source over limit\n", a);
+		counters[COUNT_SOURCE]++;
+	} else if ((data = getservice(service)->nroutes > 0
+		? deferroute(s, service, !wait, &route)
+		: wait ? deferpeek(s) : 1) > 0 && !deferprereads(service)) {
+		return startsession(service, route, s, -1, a, &source);
+	} else if (data >= 0 && mkcloexec(s)) {
+		/* waiting sockets must not leak into workers either */
+		const uint_fast64_t held = data == 0 ? deferheld(service) : 0;
+		const Pending p = {
+			s, -1, a, source, held < now ? now - held : 0, service,
+			SIZE_MAX
+		};
+		deferpush(&p);
+		return false;
+	} else {
+		sourcerelease(&source);
+		counters[COUNT_IDLE]++;
+	}
+	free(a);
+	close(s);
+	return false;
+}
+
+/*
+ * Receive the datagrams of service, no more than there are sessions to start
+ * them, and start them.  Datagrams turned down are dropped.  Return true on
+ * failure.
+ */
+static bool receivedatagrams(const size_t service)
+{
+	const bool batch = getdatagram()->mode == DGRAM_BATCH;
+	const int listener = getservice(service)->listener;
+	const int n = dgramreceive(listener, batch ? SIZE_MAX
+		: freeslots(service));
+	if (n < 0)
+		return propagateacceptfailure(errno) && errno != EAGAIN
+			&& errno != EWOULDBLOCK;
+	counters[COUNT_DATAGRAMS] += n;
+	const size_t per = batch ? (size_t) n : 1;
+	for (size_t i = 0; i < (size_t) n; i += per) {
+		int input, output, reason;
+		char *remote;
+		SourceKey source;
+		const size_t job = dgramjob(i, per, &input, &output, &remote,
+			&source);
+		if (job == SIZE_MAX) {
+			perror("Could not store datagram");
+			continue;
+		}
+		bool started = false;
+		if (source.family != AF_UNSPEC && !sourceadmit(&source, now)) {
+			counters[COUNT_SOURCE]++;
+			goto next;
+		}
+		if ((reason = overloaded(listener, false, 0, now)) >= 0)
+			counters[reason]++;
+		else if (!breakerallows(now))
+			counters[COUNT_SHED_BREAKER]++;
+		else if (addproc(service, SIZE_MAX, output, input, remote,
+			&source))
+			fprintf(stderr, "Could not start session (%s): %s\n",
+				remote, strerror(errno));
+		else
+			started = true;
+		if (started)
+			processes[nproc - 1].job = job;
+		else
+			sourcerelease(&source);
+next:
+		if (!started)
+			dgramdiscard(job);
+		close(input);
+		free(remote);
+	}
+	return false;
+}
+
+/*
+ * Start a session for the sender of datagram i of those just received on
+ * service, with a sequenced packet socket to give it the datagrams of its peer.
+ * Return the session of the peer, or SIZE_MAX if it was turned down.
+ */
+static size_t startpeer(const size_t service, const size_t i)
+{
+	const int listener = getservice(service)->listener;
+	const Peer * const peer = dgrampeer(i);
+	SourceKey source;
+	char * const remote = describeremote(-1,
+		(const struct sockaddr *) &peer->address, &source);
+	if (!remote)
+		return SIZE_MAX;
+	int sv[2], reason;
+	size_t session = SIZE_MAX;
+	/* datagrams are never queued, so new peers wait for no slot */
+	if (!haveslot(service) || throttled())
+		goto done;
+	if (source.family != AF_UNSPEC && !sourceadmit(&source, now)) {
+		counters[COUNT_SOURCE]++;
+		goto done;
+	}
+	if ((reason = overloaded(listener, false, 0, now)) >= 0)
+		counters[reason]++;
+	else if (!breakerallows(now))
+		counters[COUNT_SHED_BREAKER]++;
+	else if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+		perror("Could not create peer socket");
+	else if (!mkcloexec(sv[0])
+		|| (session = peeradd(service, peer, sv[0], now)) == SIZE_MAX) {
+		perror("Could not add peer session");
+		close(sv[0]);
+		close(sv[1]);
+	} else if (addproc(service, SIZE_MAX, sv[1], -1, remote, &source)) {
+		fprintf(stderr, "Could not start session (%s): %s\n",
+			remote, strerror(errno));
+		peerend(session);
+		session = SIZE_MAX;
+		close(sv[1]);
+	} else {
+		processes[nproc - 1].peer = session;
+		close(sv[1]);
+		free(remote);
+		return session;
+	}
+	if (source.family != AF_UNSPEC)
+		sourcerelease(&source);
+done:
+	free(remote);
+	return SIZE_MAX;
+}
+
+/*
+ * Receive the datagrams of service and give each to the worker of its peer,
+ * starting one for new peers.  Datagrams that no worker takes are dropped.
+ * Return true on failure.
+ */
+static bool routedatagrams(const size_t service)
+{
+	const int n = dgramreceive(getservice(service)->listener, SIZE_MAX);
+	if (n < 0)
+		return propagateacceptfailure(errno) && errno != EAGAIN
+			&& errno != EWOULDBLOCK;
+	counters[COUNT_DATAGRAMS] += n;
+	for (size_t i = 0; i < (size_t) n; i++) {
+		size_t length, session = peerfind(service, dgrampeer(i));
+		const char * const data = dgramdata(i, &length);
+		if (session == SIZE_MAX)
+			session = startpeer(service, i);
+		if (session == SIZE_MAX || peersend(session, data, length, now))
+			counters[COUNT_PEER_DROPPED]++;
+	}
+	return false;
+}
+
+/* Start the sessions of waiting connections that sent data. */
+static void dispatchdeferred(void)
+{
+	Pending p;
+	while (deferready(&p, now, blocked)) {
+		if (startsession(p.service, p.route, p.sock, p.input,
+			p.remote, &p.source))
+			fprintf(stderr,
+				"Could not start deferred session: %s\n",
+				strerror(errno));
+	}
+}
+
+static int polltimeout(void)
+{
+	int timeout = dropping ? DROP_REPORT_PERIOD : -1;
+	/* connections waiting for the spawn rate, queued or in the backlog */
+	if (throttled() && (queuelength() > 0 || queuefull()
+		|| deferblocked() > 0)) {
+		const uint_fast64_t left = bucketwait(&spawns, 1);
+		if (timeout < 0 || left < (uint_fast64_t) timeout)
+			timeout = left;
+	}
+	const uint_fast32_t wait = getqueueoptions()->timeout;
+	const Pending * const p = queueat(0);
+	if (p && wait > 0) {
+		const uint_fast64_t deadline = p->since + wait;
+		const uint_fast64_t left = deadline > now ? deadline - now : 0;
+		if (timeout < 0 || left < (uint_fast64_t) timeout)
+			timeout = left;
+	}
+	const int probe = breakertimeout(now);
+	if (probe >= 0 && (timeout < 0 || probe < timeout))
+		timeout = probe;
+	const int idle = defertimeout(now);
+	if (idle >= 0 && (timeout < 0 || idle < timeout))
+		timeout = idle;
+	const int silent = peertimeout(now);
+	if (silent >= 0 && (timeout < 0 || silent < timeout))
+		timeout = silent;
+	return timeout;
+}
+
+/*
+ * Reload the configuration file, renumbering the services of sessions and
+ * waiting connections.  Sessions of services gone keep running, but those
+ * still waiting for one are closed.  Return -1 on failure.
+ */
+int reload()
+{
+	size_t ns;
+	size_t * const map = cmdreload(&ns);
+	if (!map)
+		return -1;
+	if (!fds) {
+		/* resume() has not set up anything yet */
+		cmdcommit(map);
+		free(map);
+		return 0;
+	}
+	/* allocate first so that failure leaves the running services alone */
+	size_t * const newrunning = calloc(ns + 1, sizeof *running);
+	size_t * const newqueued = calloc(ns + 1, sizeof *queued);
+	short * const newincoming = calloc(ns + 1, sizeof *incoming);
+	bool * const rerouted = calloc(ns + 1, sizeof *rerouted);
+	const size_t size = pollsize(ns, cproc) > pollsize(getnservices(),
+		cproc) ? pollsize(ns, cproc) : pollsize(getnservices(), cproc);
+	struct pollfd * const newfds = realloc(fds, size * sizeof *fds);
+	if (newfds)
+		fds = newfds;
+	if (!newrunning || !newqueued || !newincoming || !rerouted
+		|| !newfds) {
+		const int e = errno;
+		free(newrunning);
+		free(newqueued);
+		free(newincoming);
+		free(rerouted);
+		cmdabandon();
+		free(map);
+		errno = e;
+		return -1;
+	}
+	for (size_t i = 0; i < getnservices(); i++) {
+		if (map[i] != SIZE_MAX)
+			rerouted[map[i]] = cmdrerouted(i, map[i]);
+	}
+	cmdcommit(map);
+	free(running);
+	free(queued);
+	free(incoming);
+	running = newrunning;
+	queued = newqueued;
+	incoming = newincoming;
+	for (size_t i = 0; i < nproc; i++) {
+		size_t * const service = &processes[i].service;
+		if (*service != SIZE_MAX && (*service = map[*service])
+			!= SIZE_MAX)
+			running[*service]++;
+	}
+	const size_t closed = queueremap(map, rerouted)
+		+ deferremap(map, rerouted) + peerremap(map);
+	free(map);
+	free(rerouted);
+	countqueued();
+	for (size_t i = 0; i < ns; i++)
+		deferlisten(i);
+	logprintf("Configuration reloaded: %zu services, %zu connections "
+		"closed\n", ns, closed);
+	return 0;
+}
+
+/*
+ * Replace this process by a new instance of the program as started by argv,
+ * handing it over the listeners, the workers along with their pending error
+ * output, the connections waiting for them and the counters.  Return only on
+ * failure, with everything kept as it was.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+int upgrade(char * const argv[])
+{
+	FILE * const state = statecreate();
+	if (!state)
+		return -1;
+	const size_t ns = getnservices();
+	stateputnum(state, ns);
+	for (size_t i = 0; i < ns; i++) {
+		const Service * const svc = getservice(i);
+		stateputnum(state, svc->type);
+		stateputbytes(state, svc->address, svc->address_len);
+		stateputfd(state, svc->listener);
+	}
+	stateputnum(state, nproc);
+	for (size_t i = 0; i < nproc; i++) {
+		const ProcessData * const proc = &processes[i];
+		stateputnum(state, proc->pid);
+		stateputfd(state, fds[NFIXED + i].fd);
+		stateputnum(state, proc->service);
+		stateputnum(state, proc->start);
+		stateputnum(state, proc->dropped);
+		stateputnum(state, proc->skip);
+		stateputnum(state, proc->raw);
+		stateputnum(state, proc->source.address);
+		stateputnum(state, proc->source.family);
+		stateputbytes(state, proc->ebuf, proc->nebuf);
+		stateputnum(state, proc->job);
+		stateputnum(state, proc->peer);
+	}
+	metricssave(state);
+	queuesave(state);
+	defersave(state);
+	dgramsave(state);
+	peersave(state);
+	handoffsave(state);
+	logprintf("Upgrading with %zu sessions running\n", nproc);
+	/* lines still buffered would be lost with the writer thread */
+	logflush();
+	statehandover(state, argv);
+	return -1;
+}
+
+/*
+ * Take over the workers and connections handed over by upgrade() in the
+ * process this one replaced.  Return true on failure.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+static bool restore(FILE * const state)
+{
+	const LogOptions * const limits = getlogoptions();
+	uintmax_t n;
+	if (stategetnum(state, &n))
+		return true;
+	for (uintmax_t i = 0; i < n; i++) {
+		uintmax_t pid, service, start, dropped, skip, raw, address,
+			family, job, peer;
+		int fd;
+		if (stategetnum(state, &pid) || stategetfd(state, &fd)
+			|| stategetnum(state, &service)
+			|| stategetnum(state, &start)
+			|| stategetnum(state, &dropped)
+			|| stategetnum(state, &skip) || stategetnum(state, &raw)
+			|| stategetnum(state, &address)
+			|| stategetnum(state, &family) || allocproc())
+			return true;
+		ProcessData * const proc = &processes[nproc];
+		if (!(proc->ebuf = stategetbytes(state, &proc->nebuf))
+			|| stategetnum(state, &job)
+			|| stategetnum(state, &peer)) {
+			free(proc->ebuf);
+			if (fd >= 0)
+				close(fd);
+			return true;
+		}
+		proc->job = job;
+		proc->peer = peer;
+		proc->cebuf = proc->nebuf;
+		proc->pid = pid;
+		bucketinit(&proc->lines, limits->lines, limits->lines, now);
+		bucketinit(&proc->bytes, limits->bytes, limits->bytes, now);
+		dropping |= (proc->dropped = dropped) > 0;
+		proc->skip = skip;
+		proc->raw = raw;
+		proc->source.address = address;
+		proc->source.family = family;
+		proc->start = start;
+		if ((proc->service = cmdadopted(service)) != SIZE_MAX)
+			running[proc->service]++;
+		sourceadopt(&proc->source, now);
+		fds[NFIXED + nproc].fd = fd;
+		fds[NFIXED + nproc].events = POLLIN;
+		fds[NFIXED + nproc].revents = 0;
+		nproc++;
+	}
+	gauges[GAUGE_SESSIONS] = nproc;
+	/* workers may have exited while no handler was set */
+	notifychild(SIGCHLD);
+	return metricsload(state) || queueload(state, now)
+		|| deferload(state, now) || dgramload(state)
+		|| peerload(state, now) || handoffload(state);
+}
+
 int resume()
 {
 	static bool setup = false;
 	if (!setup) {
-		if (!(fds = malloc(sizeof (struct pollfd))))
+		const size_t ns = getnservices();
+		/* waiting connections take entries of fds */
+		if (deferinit() || !(fds = malloc(pollsize(ns, 0)
+			* sizeof (struct pollfd)))
+			|| !(running = calloc(ns, sizeof *running))
+			|| !(queued = calloc(ns, sizeof *queued))
+			|| !(incoming = calloc(ns, sizeof *incoming)))
 			return -1;
-		fds->fd = getlistener();
-		fds->events = POLLIN;
 		atexit(cleanup);
+		if (watchchildren() || queueinit(getqueueoptions()->size))
+			return -1;
+		for (size_t i = 0; i < ns; i++)
+			deferlisten(i);
+		fds[SIGNALS].fd = sigpipe[0];
+		fds[SIGNALS].events = POLLIN;
+		const LogOptions * const limits = getlogoptions();
+		lastreport = now = getnow();
+		bucketinit(&totallines, limits->totallines, limits->totallines,
+			now);
+		bucketinit(&totalbytes, limits->totalbytes, limits->totalbytes,
+			now);
+		const SpawnLimit * const spawn = getspawnlimit();
+		bucketinit(&spawns, spawn->rate, spawn->burst, now);
+		rlimitsinit();
+		FILE * const state = stateinherited();
+		/* descriptors past the failure would leak into workers */
+		if (state && restore(state)) {
+			fprintf(stderr, "Could not restore the state of the "
+				"previous process\n");
+			exit(EXIT_FAILURE);
+		}
+		countqueued();
+		if (state)
+			logprintf("Upgraded with %zu sessions running\n",
+				nproc);
+		statedone();
+		if (handoffinit()) {
+			perror("Could not open the control socket");
+			exit(EXIT_FAILURE);
+		}
 		setup = true;
 	}
-	const int n = poll(fds, nproc + 1, -1);
+	/*
+	 * Leave connections in the backlog of a listener while they must wait,
+	 * backends only taking those neither routed nor pre-read.  The entries
+	 * following workers are filled anew each time since workers come and
+	 * go.
+	 */
+	gauges[GAUGE_LIMIT] = sessionlimit();
+	const bool wait = throttled();
+	if (getspawnlimit()->rate > 0)
+		gauges[GAUGE_SPAWN_TOKENS] = bucketlevel(&spawns, now);
+	const size_t ns = getnservices();
+	struct pollfd * const tail = fds + NFIXED + nproc;
+	for (size_t i = 0; i < ns; i++) {
+		const Service * const svc = getservice(i);
+		/*
+		 * Datagrams are never queued: they wait in the socket, unless
+		 * they go to peers with a worker already.
+		 */
+		const bool pause = svc->type != SOCK_DGRAM
+			? mustwait(i, svc->nroutes == 0 && !deferprereads(i))
+			: getdatagram()->mode != DGRAM_PEER && (!haveslot(i)
+			|| wait);
+		tail[i].fd = pause ? -1 : svc->listener;
+		tail[i].events = POLLIN;
+	}
+	deferpoll(tail + ns);
+	struct pollfd * const peers = tail + ns + deferlength();
+	peerpoll(peers);
+	struct pollfd * const control = peers + peerlength();
+	handoffpoll(control);
+	const int n = poll(fds, control + handofflength() - fds,
+		polltimeout());
 	if (n < 0)
 		return -(errno != EINTR);
+	for (size_t i = 0; i < ns; i++)
+		incoming[i] = tail[i].revents;
+	int iopassed = deferrevents(tail + ns) + peerrevents(peers)
+		+ handoffrevents(control);
+	now = getnow();
 	for (size_t i = 0; i < nproc; /* noop */) {
 		if (needrmproc(i))
 			rmproc(i);
 		else
 			i++;
 	}
-	int iopassed = 0;
+	peerforward();
+	handoffserve();
+	peertick(now);
+	dgramflush();
+	breakertick(now);
+	dispatchqueue();
+	dispatchdeferred();
+	if (dropping && now - lastreport >= DROP_REPORT_PERIOD) {
+		for (size_t i = 0; i < nproc; i++)
+			reportdrops(&processes[i]);
+		dropping = false;
+		lastreport = now;
+	}
+	iopassed += drainsignals();
 	for (size_t i = 0; i < nproc; i++) {
 		const int r = passprocio(i);
 		if (r < 0) {
@@ -239,21 +1259,15 @@ int resume()
 		if ((iopassed += r) == n)
 			return iopassed;
 	}
-	const bool incoming = fds[0].revents & POLLIN;
-	if (incoming) {
-		char *a;
-		const int s = acceptremote(fds[0].fd, &a);
-		if (s < 0)
-			return propagateacceptfailure(errno) ? -1 : iopassed;
-		if (addproc(s, a)) {
-			const int e = errno;
-			free(a);
-			close(s);
-			errno = e;
+	for (size_t i = 0; i < ns; i++) {
+		if (!(incoming[i] & POLLIN))
+			continue;
+		const bool dgram = getservice(i)->type == SOCK_DGRAM;
+		if (!dgram ? acceptconnection(i)
+			: getdatagram()->mode == DGRAM_PEER ? routedatagrams(i)
+			: receivedatagrams(i))
 			return -1;
-		}
-		free(a);
-		close(s);
+		iopassed++;
 	}
-	return iopassed + incoming;
+	return iopassed;
 }
@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2023 Pierre Colin
+ * This file is part of the serve utility.
+ * 
+ * The serve utility is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * The serve utility is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifdef __linux__
+/* for TCP_QUICKACK and TCP_FASTOPEN */
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "command.h"
+#include "sockopts.h"
+
+/* Whether options of level apply to the sockets of service. */
+#ifdef __GNUC__
+__attribute__((nonnull (1), pure))
+#endif
+static bool applies(const Service * const service, const int level)
+{
+	const int family = service->address->sa_family;
+	return level != IPPROTO_TCP || (service->type == SOCK_STREAM
+		&& (family == AF_INET || family == AF_INET6));
+}
+
+/* Append the call setting key to value to the n of list if set and relevant. */
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2, 3, 6)))
+#endif
+static void add(const Service * const service, size_t * const n,
+	SocketOption * const list, const int level, const int name,
+	const char * const key, const uint_fast32_t value)
+{
+	if (value > 0 && applies(service, level))
+		list[(*n)++] = (SocketOption) {level, name, value, key};
+}
+
+#if !defined(TCP_FASTOPEN) || !defined(SO_BUSY_POLL) \
+	|| !defined(TCP_QUICKACK) || !defined(TCP_KEEPIDLE) \
+	|| !defined(TCP_KEEPINTVL) || !defined(TCP_KEEPCNT)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+static void unsupported(const char * const key, const uint_fast32_t value)
+{
+	if (value > 0)
+		fprintf(stderr, "The socket option '%s' is not supported on "
+			"this system\n", key);
+}
+
+/* Report the options of o that sockoptsinit() leaves out. */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+static void report(const SocketOptions * const o)
+{
+#ifndef TCP_FASTOPEN
+	unsupported("fastopen", o->fastopen);
+#endif
+#ifndef SO_BUSY_POLL
+	unsupported("busypoll", o->busypoll);
+#endif
+#ifndef TCP_QUICKACK
+	unsupported("quickack", o->quickack);
+#endif
+#if !defined(TCP_KEEPIDLE) || !defined(TCP_KEEPINTVL) || !defined(TCP_KEEPCNT)
+	unsupported("keepidle", o->keepidle);
+	unsupported("keepintvl", o->keepintvl);
+	unsupported("keepcnt", o->keepcnt);
+#endif
+}
+#else
+#define report(o) ((void) (o))
+#endif
+
+/*
+ * Turn the socket options of service into the calls of its sockcalls, once its
+ * type is known, reporting those unsupported.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+void sockoptsinit(Service * const service)
+{
+	const SocketOptions * const o = &service->sockopts;
+	SocketCalls * const l = &service->sockcalls;
+	report(o);
+	l->nlistening = l->naccepted = 0;
+	add(service, &l->nlistening, l->listening, SOL_SOCKET, SO_SNDBUF,
+		"sndbuf", o->sndbuf);
+	add(service, &l->nlistening, l->listening, SOL_SOCKET, SO_RCVBUF,
+		"rcvbuf", o->rcvbuf);
+#ifdef TCP_FASTOPEN
+	add(service, &l->nlistening, l->listening, IPPROTO_TCP, TCP_FASTOPEN,
+		"fastopen", o->fastopen);
+#endif
+#ifdef SO_BUSY_POLL
+	add(service, &l->nlistening, l->listening, SOL_SOCKET, SO_BUSY_POLL,
+		"busypoll", o->busypoll);
+#endif
+	add(service, &l->naccepted, l->accepted, IPPROTO_TCP, TCP_NODELAY,
+		"nodelay", o->nodelay);
+#ifdef TCP_QUICKACK
+	add(service, &l->naccepted, l->accepted, IPPROTO_TCP, TCP_QUICKACK,
+		"quickack", o->quickack);
+#endif
+	add(service, &l->naccepted, l->accepted, SOL_SOCKET, SO_KEEPALIVE,
+		"keepalive", o->keepidle || o->keepintvl || o->keepcnt);
+#if defined(TCP_KEEPIDLE) && defined(TCP_KEEPINTVL) && defined(TCP_KEEPCNT)
+	add(service, &l->naccepted, l->accepted, IPPROTO_TCP, TCP_KEEPIDLE,
+		"keepidle", o->keepidle);
+	add(service, &l->naccepted, l->accepted, IPPROTO_TCP, TCP_KEEPINTVL,
+		"keepintvl", o->keepintvl);
+	add(service, &l->naccepted, l->accepted, IPPROTO_TCP, TCP_KEEPCNT,
+		"keepcnt", o->keepcnt);
+#endif
+	l->linger.l_onoff = o->setlinger;
+	l->linger.l_linger = o->linger;
+}
+
+/*
+ * Set the options of listeners on that of service before it listens.
+ * Failures are reported but leave the listener usable.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+void sockoptslisten(const Service * const service)
+{
+	const SocketCalls * const l = &service->sockcalls;
+	for (size_t i = 0; i < l->nlistening; i++) {
+		const SocketOption * const o = &l->listening[i];
+		if (setsockopt(service->listener, o->level, o->name, &o->value,
+			sizeof o->value) < 0)
+			fprintf(stderr, "Could not set socket option '%s': "
+				"%s\n", o->key, strerror(errno));
+	}
+}
+
+/*
+ * Set the options of accepted sockets on sock, accepted by the listener of
+ * service.  Failures are ignored since they would be reported for each
+ * connection.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (2)))
+#endif
+void sockoptsaccept(const int sock, const Service * const service)
+{
+	const SocketCalls * const l = &service->sockcalls;
+	for (size_t i = 0; i < l->naccepted; i++) {
+		const SocketOption * const o = &l->accepted[i];
+		(void) setsockopt(sock, o->level, o->name, &o->value,
+			sizeof o->value);
+	}
+	if (l->linger.l_onoff)
+		(void) setsockopt(sock, SOL_SOCKET, SO_LINGER, &l->linger,
+			sizeof l->linger);
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2023 Pierre Colin
+ * This file is part of the serve utility.
+ * 
+ * The serve utility is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * The serve utility is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/* Service is declared in command.h */
+
+void sockoptsinit(Service *service)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+void sockoptslisten(const Service *service)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+void sockoptsaccept(int sock, const Service *service)
+#ifdef __GNUC__
+__attribute__((nonnull (2)))
+#endif
+;
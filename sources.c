@@ -0,0 +1,205 @@
+/*
+ * Copyright (C) 2023 Pierre Colin
+ * This file is part of the serve utility.
+ * 
+ * The serve utility is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * The serve utility is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bucket.h"
+#include "command.h"
+#include "remote.h"
+#include "sources.h"
+
+/*
+ * Open-addressing hash table with linear probing of the sources seen
+ * recently.  An entry is stale once its source has no session and its
+ * bucket would be full again: forgetting it then changes nothing.  Stale
+ * entries are swept whenever the table fills up, before growing it.
+ */
+typedef struct {
+	SourceKey key;
+	Bucket bucket;
+	uint_fast32_t sessions;
+	bool used;
+} Source;
+
+static Source *table;
+static size_t nsources, csources;
+static uint_least64_t seed;
+
+static void cleanup(void)
+{
+	free(table);
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1), pure))
+#endif
+static size_t hash(const SourceKey * const restrict key)
+{
+	/* finalizer of SplitMix64, keyed so that peers cannot aim collisions */
+	uint_least64_t x = key->address ^ seed ^ (uint_least64_t) key->family
+		<< 56;
+	x = (x ^ x >> 30) * UINT64_C(0xbf58476d1ce4e5b9);
+	x = (x ^ x >> 27) * UINT64_C(0x94d049bb133111eb);
+	x = (x ^ x >> 31) & UINT64_C(0xffffffffffffffff);
+	return x & (csources - 1);
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2), pure))
+#endif
+static bool equal(const SourceKey * const a, const SourceKey * const b)
+{
+	return a->address == b->address && a->family == b->family;
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+static Source *lookup(const SourceKey * const restrict key)
+{
+	size_t i = hash(key);
+	while (table[i].used && !equal(&table[i].key, key))
+		i = (i + 1) & (csources - 1);
+	return &table[i];
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+static bool stale(Source * const s, const uint_fast64_t now)
+{
+	return s->sessions == 0 && bucketlevel(&s->bucket, now)
+		>= s->bucket.burst;
+}
+
+/* Rebuild the table with n slots, leaving stale entries out. */
+static bool rehash(const size_t n, const uint_fast64_t now)
+{
+	Source * const old = table;
+	const size_t cold = csources;
+	if (!(table = calloc(n, sizeof *table))) {
+		table = old;
+		return true;
+	}
+	csources = n;
+	nsources = 0;
+	for (size_t i = 0; i < cold; i++) {
+		if (old[i].used && !stale(&old[i], now)) {
+			*lookup(&old[i].key) = old[i];
+			nsources++;
+		}
+	}
+	free(old);
+	return false;
+}
+
+/* Find the entry of source, creating it if needed. */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+static Source *find(const SourceKey * const source, const uint_fast64_t now)
+{
+	const SourceLimits * const limits = getsourcelimits();
+	/* not tied to table, which stays NULL if allocating it fails */
+	static bool ready = false;
+	if (!ready) {
+		ready = true;
+		seed = (uint_least64_t) time(NULL) << 32 ^ getpid();
+		atexit(cleanup);
+	}
+	/* keep the load factor under 3/4 */
+	if (4 * (nsources + 1) > 3 * csources) {
+		size_t n = csources == 0 ? 64 : csources;
+		if (rehash(n, now))
+			return NULL;
+		if (4 * (nsources + 1) > 3 * csources / 2
+			&& rehash(2 * n, now))
+			return NULL;
+	}
+	Source * const s = lookup(source);
+	if (!s->used) {
+		s->key = *source;
+		s->used = true;
+		s->sessions = 0;
+		bucketinit(&s->bucket, limits->rate, limits->burst, now);
+		nsources++;
+	}
+	return s;
+}
+
+/*
+ * Count a connection from source against its limits, and tell whether it may
+ * proceed.  If it may, sourcerelease() must be called once its session ends.
+ * Connections that cannot be counted for lack of memory are turned down.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+bool sourceadmit(const SourceKey * const source, const uint_fast64_t now)
+{
+	const SourceLimits * const limits = getsourcelimits();
+	if (limits->sessions == 0 && limits->rate == 0)
+		return true;
+	Source * const s = find(source, now);
+	if (!s)
+		return false;
+	if ((limits->sessions > 0 && s->sessions >= limits->sessions)
+		|| !bucketcan(&s->bucket, 1, now))
+		return false;
+	buckettake(&s->bucket, 1);
+	s->sessions++;
+	return true;
+}
+
+/*
+ * Count a session of source admitted by a previous serve process.  If it
+ * cannot be counted, its family is set to AF_UNSPEC so that sourcerelease()
+ * leaves the sessions of others alone.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+void sourceadopt(SourceKey * const source, const uint_fast64_t now)
+{
+	const SourceLimits * const limits = getsourcelimits();
+	if (source->family == AF_UNSPEC
+		|| (limits->sessions == 0 && limits->rate == 0))
+		return;
+	Source * const s = find(source, now);
+	if (s)
+		s->sessions++;
+	else
+		source->family = AF_UNSPEC;
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+void sourcerelease(const SourceKey * const source)
+{
+	if (!table || source->family == AF_UNSPEC)
+		return;
+	Source * const s = lookup(source);
+	if (s->used && s->sessions > 0)
+		s->sessions--;
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2023 Pierre Colin
+ * This file is part of the serve utility.
+ * 
+ * The serve utility is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * The serve utility is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+/* SourceKey is declared in remote.h */
+
+bool sourceadmit(const SourceKey *source, uint_fast64_t now)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+void sourceadopt(SourceKey *source, uint_fast64_t now)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+void sourcerelease(const SourceKey *source)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
@@ -0,0 +1,266 @@
+/*
+ * Copyright (C) 2023 Pierre Colin
+ * This file is part of the serve utility.
+ * 
+ * The serve utility is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * The serve utility is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifdef __linux__
+/* for memfd_create() */
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#include "state.h"
+
+#define STATE_ENV "SERVE_STATE"
+#define STATE_MAGIC "serve state 1\n"
+
+_Bool mkcloexec(int fildes);
+
+/*
+ * The state a process hands over to the one replacing it is a stream of
+ * decimal numbers, each on its own line, and of byte strings prefixed by
+ * their length.  Descriptors are written as numbers, and are recorded so that
+ * they can be inherited by the new process image.
+ */
+static int *handed;
+static size_t nhanded, chanded;
+static bool lost;
+static FILE *inherited;
+
+/*
+ * Return an anonymous file named name where it shows, open for reading and
+ * writing and closed upon exec(), which can be sealed where supported, or -1.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+int mkanonfile(const char * const name)
+{
+#if defined(__linux__) && defined(MFD_ALLOW_SEALING)
+	return memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+	(void) name;
+	char path[] = "/tmp/serve.XXXXXX";
+	const int fd = mkstemp(path);
+	if (fd < 0)
+		return -1;
+	unlink(path);
+	if (!mkcloexec(fd)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+#endif
+}
+
+/* Return an empty state to be handed over, or NULL on failure. */
+FILE *statecreate()
+{
+	const int fd = mkanonfile("state");
+	if (fd < 0)
+		return NULL;
+	FILE * const state = fdopen(fd, "w+");
+	if (!state) {
+		close(fd);
+		return NULL;
+	}
+	fputs(STATE_MAGIC, state);
+	nhanded = 0;
+	lost = false;
+	return state;
+}
+
+static void setcloexec(const int fd, const bool on)
+{
+	const int flags = fcntl(fd, F_GETFD);
+	if (flags >= 0)
+		fcntl(fd, F_SETFD, on ? flags | FD_CLOEXEC
+			: flags & ~FD_CLOEXEC);
+}
+
+/*
+ * Run the program of argv again with state and the descriptors it holds.  On
+ * failure, return true with state closed and the descriptors kept.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2)))
+#endif
+bool statehandover(FILE * const state, char * const argv[])
+{
+	const int fd = fileno(state);
+	char env[24];
+	snprintf(env, sizeof env, "%d", fd);
+	if (lost) {
+		errno = ENOMEM;
+		goto failure;
+	}
+	if (fflush(state) == EOF || ferror(state) || fseek(state, 0, SEEK_SET)
+		|| setenv(STATE_ENV, env, 1) < 0)
+		goto failure;
+	for (size_t i = 0; i < nhanded; i++)
+		setcloexec(handed[i], false);
+	setcloexec(fd, false);
+	execvp(argv[0], argv);
+	for (size_t i = 0; i < nhanded; i++)
+		setcloexec(handed[i], true);
+	unsetenv(STATE_ENV);
+
+failure:;
+	const int e = errno;
+	fclose(state);
+	free(handed);
+	handed = NULL;
+	nhanded = chanded = 0;
+	errno = e;
+	return true;
+}
+
+/*
+ * Return the state handed over by the process this one replaces, or NULL if
+ * it was started anew.  A state that cannot be read is fatal, since the
+ * descriptors it names are left over.
+ */
+FILE *stateinherited()
+{
+	static bool checked = false;
+	if (checked)
+		return inherited;
+	checked = true;
+	const char * const env = getenv(STATE_ENV);
+	if (!env)
+		return NULL;
+	char *end;
+	const long fd = strtol(env, &end, 10);
+	char magic[sizeof STATE_MAGIC];
+	if (*env == 0 || *end != 0 || fd < 0 || fd > INT_MAX
+		|| !mkcloexec(fd) || !(inherited = fdopen(fd, "r"))
+		|| !fgets(magic, sizeof magic, inherited)
+		|| strcmp(magic, STATE_MAGIC) != 0) {
+		fprintf(stderr, "Could not read the state of the previous "
+			"process\n");
+		exit(EXIT_FAILURE);
+	}
+	unsetenv(STATE_ENV);
+	return inherited;
+}
+
+/* Close the inherited state once everything was read. */
+void statedone()
+{
+	if (inherited)
+		fclose(inherited);
+	inherited = NULL;
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+void stateputnum(FILE * const state, const uintmax_t n)
+{
+	fprintf(state, "%ju\n", n);
+}
+
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+void stateputbytes(FILE * const state, const void * const buf,
+	const size_t n)
+{
+	stateputnum(state, n);
+	if (n > 0)
+		fwrite(buf, 1, n, state);
+}
+
+/* Write descriptor fd, or -1, to be inherited by the new process. */
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+void stateputfd(FILE * const state, const int fd)
+{
+	stateputnum(state, fd + 1);
+	if (fd < 0)
+		return;
+	if (nhanded == chanded) {
+		const size_t n = chanded == 0 ? 16 : 2 * chanded;
+		int * const newptr = realloc(handed, n * sizeof *handed);
+		if (!newptr) {
+			/* fails the handover, see statehandover() */
+			lost = true;
+			return;
+		}
+		handed = newptr;
+		chanded = n;
+	}
+	handed[nhanded++] = fd;
+}
+
+/* Read a number into n.  Return true on failure. */
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2)))
+#endif
+bool stategetnum(FILE * const state, uintmax_t * const n)
+{
+	return fscanf(state, "%" SCNuMAX, n) != 1 || getc(state) != '\n';
+}
+
+/*
+ * Return a byte string, followed by a null byte not counted in n, or NULL on
+ * failure.
+ */
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2)))
+#endif
+char *stategetbytes(FILE * const state, size_t * const n)
+{
+	uintmax_t len;
+	if (stategetnum(state, &len) || len >= SIZE_MAX)
+		return NULL;
+	char * const buf = malloc(len + 1);
+	if (!buf)
+		return NULL;
+	if (fread(buf, 1, len, state) != len) {
+		free(buf);
+		return NULL;
+	}
+	buf[len] = 0;
+	*n = len;
+	return buf;
+}
+
+/* Read a descriptor, or -1, into fd.  Return true on failure. */
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2)))
+#endif
+bool stategetfd(FILE * const state, int * const fd)
+{
+	uintmax_t n;
+	if (stategetnum(state, &n) || n > INT_MAX)
+		return true;
+	*fd = (int) n - 1;
+	return *fd >= 0 && !mkcloexec(*fd);
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2023 Pierre Colin
+ * This file is part of the serve utility.
+ * 
+ * The serve utility is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * The serve utility is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * the serve utility.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+int mkanonfile(const char *name)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+FILE *statecreate(void);
+
+bool statehandover(FILE *state, char *const argv[])
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2)))
+#endif
+;
+
+FILE *stateinherited(void);
+
+void statedone(void);
+
+void stateputnum(FILE *state, uintmax_t n)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+void stateputbytes(FILE *state, const void *buf, size_t n)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+void stateputfd(FILE *state, int fd)
+#ifdef __GNUC__
+__attribute__((nonnull (1)))
+#endif
+;
+
+bool stategetnum(FILE *state, uintmax_t *n)
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2)))
+#endif
+;
+
+char *stategetbytes(FILE *state, size_t *n)
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2)))
+#endif
+;
+
+bool stategetfd(FILE *state, int *fd)
+#ifdef __GNUC__
+__attribute__((nonnull (1, 2)))
+#endif
+;